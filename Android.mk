@@ -43,6 +43,10 @@ common_libintelprov_files := \
 	util.c \
 	flash_ops.c \
 	flash.c \
+	verify.c \
+	property.c \
+	perf.c \
+	erase_queue.c \
 	$(MODULES-SOURCES)
 
 common_libintelprov_includes := \
@@ -56,7 +60,7 @@ sep_lib_includes := $(chaabi_dir)/SepMW/VOS6/External/Linux/inc/
 ifeq ($(BUILD_WITH_SECURITY_FRAMEWORK),chaabi_token)
 include $(CLEAR_VARS)
 LOCAL_MODULE := teeprov
-LOCAL_SRC_FILES := teeprov.c tee_connector.c util.c
+LOCAL_SRC_FILES := teeprov.c tee_connector.c util.c perf.c
 LOCAL_MODULE_TAGS := optional
 LOCAL_C_INCLUDES := $(common_libintelprov_includes) bootable/recovery
 LOCAL_CFLAGS := -Wall -Werror -Wno-unused-parameter
@@ -68,7 +72,7 @@ endif
 # Partitionning library
 include $(CLEAR_VARS)
 LOCAL_MODULE := liboempartitioning_static
-LOCAL_SRC_FILES := oem_partition.c
+LOCAL_SRC_FILES := oem_partition.c partition_plan.c
 LOCAL_MODULE_TAGS := optional
 LOCAL_C_INCLUDES := bootable/droidboot/volumeutils $(LOCAL_PATH)/gpt/lib/include
 LOCAL_WHOLE_STATIC_LIBRARIES := libcgpt_static
@@ -158,6 +162,7 @@ include $(CLEAR_VARS)
 LOCAL_MODULE_TAGS := optional
 LOCAL_MODULE := flashtool
 LOCAL_SHARED_LIBRARIES := liblog libcutils
+LOCAL_STATIC_LIBRARIES := libmincrypt
 
 LOCAL_C_INCLUDES := $(common_libintelprov_includes) $(call include-path-for, recovery)
 LOCAL_SRC_FILES := flashtool.c $(common_libintelprov_files)
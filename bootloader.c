@@ -16,13 +16,19 @@
 
 #include <bootimg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
 #include "util.h"
 #include "flash.h"
+#include "flash_ops.h"
+#include "fw_version_check.h"
+#include "update_osip.h"
 #include "fastboot.h"
 #include "droidboot_plugin.h"
 #include "bootloader.h"
@@ -34,35 +40,295 @@
 #define CAPSULE_MAGIC       "CAPSULE!"
 #define ESP_MAGIC           "ESP!!!!!"
 
-static bool next_component(struct bootloader_hdr *bootl_hdr,
-			   struct component_hdr **c_hdr, unsigned sz)
+/* Components are flashed in this order. Components with different
+ * targets go to different devices and are flashed concurrently, once
+ * droidboot itself has been flashed. */
+enum component_target {
+	TARGET_EMMC,		/* OS images on the eMMC user area */
+	TARGET_IFWI,		/* eMMC boot partitions, or SCU IPC */
+	TARGET_CAPSULE,		/* FWUP capsule partition */
+	TARGET_ESP,		/* ESP vfat filesystem */
+	TARGET_COUNT
+};
+
+struct component;
+
+struct component_type {
+	const char *magic;
+	const char *name;
+	enum component_target target;
+	/* true if the device already runs this component */
+	bool (*is_current)(const struct component_type *type, const struct component *c);
+};
+
+struct component {
+	const struct component_type *type;	/* NULL if unknown */
+	void *data;
+	uint32_t size;
+	uint8_t flags;
+};
+
+/* OS images are compared byte for byte with what the bootimage backend
+ * reads back from the device. The OSIP backend reads the image back
+ * behind a header page it makes up from the OSII, so only the payloads
+ * are compared there; the image on the device is padded to a whole
+ * number of LBAs. A blank or unreadable target is not worth reporting,
+ * it only means the image has to be flashed. */
+static bool image_is_current(const struct component_type *type, const struct component *c)
 {
-	if (*c_hdr == NULL) {
-		*c_hdr = (struct component_hdr *) (bootl_hdr + 1);
-		return true;
+	void *data;
+	int size;
+	uint32_t skip = 0, len = c->size;
+	bool was_quiet, same;
+
+	if (!strcmp(flash_ops_backends()->bootimage, "osip")) {
+		if (c->size <= LBA_SIZE)
+			return false;
+		skip = LBA_SIZE;
+		len = LBA_SIZE + (c->size - LBA_SIZE + LBA_SIZE - 1) / LBA_SIZE * LBA_SIZE;
 	}
 
-	*c_hdr = (struct component_hdr *)((long)(*c_hdr + 1) + (*c_hdr)->size);
-	return (unsigned long)*c_hdr - (unsigned long)bootl_hdr < sz;
+	was_quiet = util_quiet(true);
+	size = map_image(type->name, &data);
+	util_quiet(was_quiet);
+	if (size < 0)
+		return false;
+
+	same = (uint32_t)size == len &&
+	    !memcmp((char *)data + skip, (char *)c->data + skip, c->size - skip);
+	unmap_image(data, size);
+	return same;
 }
 
-static bool next_component_filter(struct bootloader_hdr *bootl_hdr,
-				  struct component_hdr **c_hdr, unsigned sz,
-				  const char* filter)
+/* The IFWI can't be read back, so it is compared by the versions the
+ * SCU reports against the ones in the FIPs of the new image, using the
+ * FIP layout of the IFWI backend. The short layout has chaabi versions
+ * the SCU doesn't report: an image that sets them is always flashed. */
+static bool ifwi_is_current_short(const struct component *c)
 {
-	printf("Looking for %s\n", filter);
-	while (next_component(bootl_hdr, c_hdr, sz))
-		if (!strncmp((*c_hdr)->magic, filter, strlen(filter)) &&
-		    (*c_hdr)->flags & FLAG_FLASH)
-			return true;
-	return false;
+	struct firmware_versions cur, img;
+
+	if (get_current_fw_rev(&cur) || get_image_fw_rev(c->data, c->size, &img))
+		return false;
+
+	if (!img.ifwi.major && !img.ifwi.minor)
+		return false;
+
+	if (img.chaabi_icache.major || img.chaabi_icache.minor ||
+	    img.chaabi_res.major || img.chaabi_res.minor ||
+	    img.chaabi_ext.major || img.chaabi_ext.minor)
+		return false;
+
+	return !memcmp(&cur.ifwi, &img.ifwi, sizeof(cur.ifwi)) &&
+	    !memcmp(&cur.scu, &img.scu, sizeof(cur.scu)) &&
+	    !memcmp(&cur.oem, &img.oem, sizeof(cur.oem)) &&
+	    !memcmp(&cur.punit, &img.punit, sizeof(cur.punit)) &&
+	    !memcmp(&cur.ia32, &img.ia32, sizeof(cur.ia32)) &&
+	    !memcmp(&cur.supp_ia32, &img.supp_ia32, sizeof(cur.supp_ia32));
+}
+
+static bool ifwi_is_current_long(const struct component *c)
+{
+	struct firmware_versions_long cur, img;
+
+	if (get_current_fw_rev_long(&cur) || get_image_fw_rev_long(c->data, c->size, &img))
+		return false;
+
+	if (!img.ifwi.major && !img.ifwi.minor)
+		return false;
+
+	/* The SCU bootstrap version is not in the FIP */
+	return !memcmp(&cur.scu, &img.scu, sizeof(cur.scu)) &&
+	    !memcmp(&cur.ia32, &img.ia32, sizeof(cur.ia32)) &&
+	    !memcmp(&cur.valhooks, &img.valhooks, sizeof(cur.valhooks)) &&
+	    !memcmp(&cur.ifwi, &img.ifwi, sizeof(cur.ifwi)) &&
+	    !memcmp(&cur.chaabi, &img.chaabi, sizeof(cur.chaabi)) &&
+	    !memcmp(&cur.mia, &img.mia, sizeof(cur.mia));
+}
+
+static bool ifwi_is_current(const struct component_type *type, const struct component *c)
+{
+	const char *backend = flash_ops_backends()->ifwi;
+	bool was_quiet, same;
+
+	was_quiet = util_quiet(true);
+	if (!strcmp(backend, "scu_emmc"))
+		same = ifwi_is_current_long(c);
+	else if (!strcmp(backend, "scu_ipc"))
+		same = ifwi_is_current_short(c);
+	else
+		same = false;
+	util_quiet(was_quiet);
+	return same;
+}
+
+/* The capsule backend compares $MN2 versions itself, and the ESP
+ * update file is consumed by the firmware, so both are always handed
+ * over. */
+static const struct component_type types[] = {
+	{ DROIDBOOT_MAGIC, FASTBOOT_OS_NAME, TARGET_EMMC, image_is_current },
+	{ IFWI_MAGIC, IFWI_NAME, TARGET_IFWI, ifwi_is_current },
+	{ SPLASHSCREEN_MAGIC, SPLASHSCREEN_NAME, TARGET_EMMC, image_is_current },
+	{ CAPSULE_MAGIC, CAPSULE_NAME, TARGET_CAPSULE, NULL },
+	{ ESP_MAGIC, ESP_UPDATE_NAME, TARGET_ESP, NULL },
+};
+
+struct component_index {
+	struct component *c;
+	unsigned count;
+};
+
+static const struct component_type *component_type(const struct component_hdr *c_hdr)
+{
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(types); i++)
+		if (!strncmp(c_hdr->magic, types[i].magic, COMPONENT_MAGIC_SIZE))
+			return &types[i];
+	return NULL;
+}
+
+/* Walk the bundle and count its components, making sure each header and
+ * payload lies within the sz bytes that were downloaded. When c is not
+ * NULL, every component is also recorded there. */
+static int walk_components(void *data, unsigned sz, struct component *c, unsigned *count)
+{
+	unsigned char *p = (unsigned char *)data + sizeof(struct bootloader_hdr);
+	unsigned char *end = (unsigned char *)data + sz;
+	struct component_hdr *c_hdr;
+
+	*count = 0;
+	while (p < end) {
+		if ((size_t)(end - p) < sizeof(*c_hdr)) {
+			if (c)
+				print("Ignoring %zd trailing bytes\n", end - p);
+			break;
+		}
+
+		c_hdr = (struct component_hdr *)p;
+		if (c_hdr->size > (size_t)(end - p) - sizeof(*c_hdr)) {
+			error("Component %.8s at offset %zd overflows the bundle (%u bytes)\n",
+			      c_hdr->magic, p - (unsigned char *)data, c_hdr->size);
+			return -1;
+		}
+
+		if (c) {
+			c->type = component_type(c_hdr);
+			c->data = c_hdr + 1;
+			c->size = c_hdr->size;
+			c->flags = c_hdr->flags;
+			if (!c->type)
+				print("Skipping unknown component %.8s\n", c_hdr->magic);
+			c++;
+		}
+		(*count)++;
+
+		p += sizeof(*c_hdr) + c_hdr->size;
+	}
+
+	return 0;
+}
+
+/* Record every component of the bundle in idx->c, which the caller
+ * frees. */
+static int index_components(void *data, unsigned sz, struct component_index *idx)
+{
+	idx->c = NULL;
+	if (walk_components(data, sz, NULL, &idx->count))
+		return -1;
+
+	idx->c = calloc(idx->count ? idx->count : 1, sizeof(*idx->c));
+	if (!idx->c) {
+		error("Can't index %u components: out of memory\n", idx->count);
+		return -1;
+	}
+
+	return walk_components(data, sz, idx->c, &idx->count);
+}
+
+struct type_result {
+	bool present;
+	bool flashed;
+	unsigned written;
+	unsigned skipped;
+	int ret;
+};
+
+/* Flash every flagged component of the given type, in bundle order. A
+ * component refused with -EPERM (not for this device) is not an error,
+ * the next one of the same type is tried instead. A component already
+ * on the device counts as flashed without being written again. */
+static void flash_type(const struct component_index *idx, const struct component_type *type,
+		       struct type_result *res)
+{
+	const struct component *c;
+	unsigned i;
+
+	res->ret = 0;
+	for (i = 0; i < idx->count; i++) {
+		c = &idx->c[i];
+		if (c->type != type || !(c->flags & FLAG_FLASH))
+			continue;
+
+		res->present = true;
+		if (type->is_current && type->is_current(type, c)) {
+			printf("%s is unchanged, skipping\n", type->name);
+			res->ret = 0;
+			res->flashed = true;
+			res->skipped++;
+			continue;
+		}
+
+		printf("flashing %s\n", type->name);
+		res->ret = aboot_flash(type->name, c->data, c->size);
+		if (res->ret != 0 && res->ret != -EPERM)
+			return;
+		if (res->ret == 0) {
+			res->flashed = true;
+			res->written++;
+		}
+	}
+}
+
+struct target_worker {
+	const struct component_index *idx;
+	enum component_target target;
+	struct type_result *res;	/* one per entry of types[] */
+};
+
+/* The targets are flashed concurrently, so their messages only go to
+ * the logs: the command thread sends the single result once they are
+ * all done. */
+static void *flash_target(void *arg)
+{
+	struct target_worker *w = arg;
+	bool was_quiet;
+	unsigned i;
+
+	was_quiet = util_quiet(true);
+	/* droidboot is flashed beforehand */
+	for (i = 1; i < ARRAY_SIZE(types); i++) {
+		if (types[i].target != w->target)
+			continue;
+		flash_type(w->idx, &types[i], &w->res[i]);
+		if (w->res[i].ret != 0 && w->res[i].ret != -EPERM)
+			break;
+	}
+	util_quiet(was_quiet);
+	return NULL;
 }
 
 int flash_bootloader(void *data, unsigned sz)
 {
 	struct bootloader_hdr *bootl_hdr = data;
-	struct component_hdr *c_hdr = NULL;
+	struct component_index idx;
+	struct type_result res[ARRAY_SIZE(types)];
+	struct target_worker w[TARGET_COUNT];
+	pthread_t thread[TARGET_COUNT];
+	bool threaded[TARGET_COUNT];
+	bool something_flashed = false;
 	int ret = -1;
+	unsigned i;
 
 	if (sz < sizeof(*bootl_hdr)) {
 		fastboot_fail("dowloaded file size is incorrect !");
@@ -74,39 +340,63 @@ int flash_bootloader(void *data, unsigned sz)
 		return ret;
 	}
 
-	unsigned i;
-
 	printf("Found bootloader rev %d version %02d.%02d\n", bootl_hdr->revision,
 		bootl_hdr->version.major, bootl_hdr->version.minor);
 
-	const char *magics[] = { DROIDBOOT_MAGIC, IFWI_MAGIC, SPLASHSCREEN_MAGIC, CAPSULE_MAGIC, ESP_MAGIC};
-	const char *names[] = { FASTBOOT_OS_NAME, IFWI_NAME, SPLASHSCREEN_NAME, CAPSULE_NAME, ESP_UPDATE_NAME};
-	bool something_flashed = false;
-	for (i = 0; i < ARRAY_SIZE(magics); i++) {
-		bool present = false;
-		bool flashed = false;
-		c_hdr = NULL;
-		while (next_component_filter(bootl_hdr, &c_hdr, sz, magics[i])) {
-			present = true;
-			printf("flashing %s\n", names[i]);
-			ret =  aboot_flash(names[i], c_hdr + 1, c_hdr->size);
-			if (ret != 0 && ret != -EPERM)
-				return ret;
-			if (ret == 0)
-				flashed = true;
-		}
-		if (present && !flashed) {
-			if (!strcmp(names[i], FASTBOOT_OS_NAME)) {
-				error("Bootloader version not supported\n");
-				return ret;
-			}
-			else
-				print("No valid %s image found\n", names[i]);
+	if (index_components(data, sz, &idx)) {
+		fastboot_fail("corrupted bootloader bundle !");
+		goto out;
+	}
+
+	memset(res, 0, sizeof(res));
+
+	/* droidboot first: a bundle without a droidboot usable on this
+	 * device is not flashed any further. */
+	flash_type(&idx, &types[0], &res[0]);
+	if (res[0].ret != 0 && res[0].ret != -EPERM) {
+		ret = res[0].ret;
+		goto out;
+	}
+	if (res[0].present && !res[0].flashed) {
+		error("Bootloader version not supported\n");
+		ret = res[0].ret;
+		goto out;
+	}
+
+	/* Probe the flash backends before the workers share them */
+	flash_ops_backends();
+
+	for (i = 0; i < TARGET_COUNT; i++) {
+		w[i].idx = &idx;
+		w[i].target = i;
+		w[i].res = res;
+		threaded[i] = !pthread_create(&thread[i], NULL, flash_target, &w[i]);
+		if (!threaded[i])
+			flash_target(&w[i]);
+	}
+
+	for (i = 0; i < TARGET_COUNT; i++)
+		if (threaded[i])
+			pthread_join(thread[i], NULL);
+
+	for (i = 0; i < ARRAY_SIZE(types); i++) {
+		if (res[i].ret != 0 && res[i].ret != -EPERM) {
+			error("Flashing %s failed\n", types[i].name);
+			ret = res[i].ret;
+			goto out;
 		}
-		something_flashed = something_flashed || flashed;
+		if (res[i].present && !res[i].flashed)
+			print("No valid %s image found\n", types[i].name);
+		if (res[i].present)
+			print("%s: %u written, %u unchanged\n", types[i].name,
+			      res[i].written, res[i].skipped);
+		something_flashed = something_flashed || res[i].flashed;
 	}
 	if (!something_flashed)
 		error("Nothing to be flashed\n");
+	ret = 0;
 
-	return 0;
+out:
+	free(idx.c);
+	return ret;
 }
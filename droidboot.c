@@ -38,7 +38,11 @@
 #include "droidboot_ui.h"
 #include "oem_partition.h"
 #include "flash.h"
+#include "flash_ops.h"
 #include "ulpmc.h"
+#include "perf.h"
+#include "erase_queue.h"
+#include "property.h"
 
 #ifdef TEE_FRAMEWORK
 #include "tee_connector.h"
@@ -203,19 +207,7 @@ out:
 #define K_MAX_ARG_LEN 256
 
 #ifndef EXTERNAL
-static int wait_property(char *prop, char *value, int timeout_sec)
-{
-	int i;
-	char v[PROPERTY_VALUE_MAX];
-
-	for (i = 0; i < timeout_sec; i++) {
-		property_get(prop, v, NULL);
-		if (!strcmp(v, value))
-			return 0;
-		sleep(1);
-	}
-	return -1;
-}
+#define FACTORY_BACKUP_TIMEOUT_MS	(60 * 1000)
 
 static int oem_backup_factory(int argc, char **argv)
 {
@@ -230,7 +222,7 @@ static int oem_backup_factory(int argc, char **argv)
 
 	property_set("sys.backup_factory", "backup");
 	ui_print("Backing up factory partition...\n");
-	if (wait_property("sys.backup_factory", "done", 60)) {
+	if (wait_property("sys.backup_factory", "done", FACTORY_BACKUP_TIMEOUT_MS)) {
 		fastboot_fail("Factory partition backing up timeout!\n");
 		return -1;
 	}
@@ -250,7 +242,7 @@ static int oem_restore_factory(int argc, char **argv)
 
 	property_set("sys.backup_factory", "restore");
 	ui_print("Restoring factory partition...\n");
-	if (wait_property("sys.backup_factory", "done", 60)) {
+	if (wait_property("sys.backup_factory", "done", FACTORY_BACKUP_TIMEOUT_MS)) {
 		fastboot_fail("Factory partition restore timeout!\n");
 		return -1;
 	}
@@ -370,6 +362,70 @@ static int oem_fastboot2adb(int argc, char **argv)
 }
 #endif	/* EXTERNAL */
 
+/* Wrappers recording flash, erase and partitioning commands in the perf
+ * ring. The flash_image() handlers record themselves. */
+#define TIMED_FLASH_CMD(name, fn)					\
+static int timed_##fn(void *data, unsigned sz)				\
+{									\
+	int ret;							\
+									\
+	perf_begin(name);						\
+	ret = fn(data, sz);						\
+	perf_end(ret);							\
+	return ret;							\
+}
+
+#define TIMED_OEM_CMD(fn)						\
+static int timed_##fn(int argc, char **argv)				\
+{									\
+	char name[PERF_NAME_LEN];					\
+	int ret;							\
+									\
+	snprintf(name, sizeof(name), "%s%s%s", argv[0],			\
+		 argc > 1 ? " " : "", argc > 1 ? argv[1] : "");		\
+	perf_begin(name);						\
+	ret = fn(argc, argv);						\
+	perf_end(ret);							\
+	return ret;							\
+}
+
+TIMED_FLASH_CMD(BOOTLOADER_NAME, flash_bootloader)
+TIMED_FLASH_CMD("dnx", flash_dnx)
+TIMED_FLASH_CMD("ifwi", flash_ifwi)
+TIMED_FLASH_CMD("token_umip", flash_token_umip)
+TIMED_FLASH_CMD("capsule", flash_capsule)
+TIMED_FLASH_CMD("ulpmc", flash_ulpmc)
+TIMED_FLASH_CMD("esp_update", flash_esp_update)
+TIMED_OEM_CMD(oem_erase_partition)
+TIMED_OEM_CMD(oem_repart_partition)
+TIMED_OEM_CMD(oem_write_osip_header)
+TIMED_OEM_CMD(oem_erase_osip_header)
+TIMED_OEM_CMD(oem_partition_cmd_handler)
+TIMED_OEM_CMD(oem_retrieve_partitions)
+TIMED_OEM_CMD(oem_wipe_partition)
+#ifndef EXTERNAL
+TIMED_OEM_CMD(oem_backup_factory)
+TIMED_OEM_CMD(oem_restore_factory)
+#endif
+
+/* oem perf: where the time of the last commands went */
+static int oem_perf(int argc, char **argv)
+{
+	perf_dump(fastboot_info);
+	return 0;
+}
+
+static int oem_backends(int argc, char **argv)
+{
+	const struct flash_backends *b = flash_ops_backends();
+	char msg[128];
+
+	snprintf(msg, sizeof(msg), "bootimage: %s ifwi: %s capsule: %s",
+		 b->bootimage, b->ifwi, b->capsule);
+	fastboot_info(msg);
+	return 0;
+}
+
 static int oem_reboot(int argc, char **argv)
 {
 	char *target_os;
@@ -388,6 +444,7 @@ static int oem_reboot(int argc, char **argv)
 	}
 
 	fastboot_okay("");
+	erase_queue_wait(NULL);
 	sync();
 
 	ui_print("REBOOT in %s...\n", target_os);
@@ -408,6 +465,8 @@ static int oem_mount(int argc, char **argv)
 		return -EINVAL;
 	}
 
+	/* Mounting goes through the same roots code as the erases */
+	erase_queue_wait(NULL);
 	ret = get_device_path(&dev_path, argv[1]);
 	if (ret) {
 		fastboot_fail("Unable to find the appropriate device path\n");
@@ -538,6 +597,7 @@ static int get_system_info(int type, char *info, unsigned sz)
 static void cmd_intel_reboot(const char *arg, void *data, unsigned sz)
 {
 	fastboot_okay("");
+	erase_queue_wait(NULL);
 	// This will cause a property trigger in init.rc to cold boot
 	property_set("sys.forcecoldboot", "yes");
 	sync();
@@ -550,6 +610,7 @@ static void cmd_intel_reboot(const char *arg, void *data, unsigned sz)
 static void cmd_intel_reboot_bootloader(const char *arg, void *data, unsigned sz)
 {
 	fastboot_okay("");
+	erase_queue_wait(NULL);
 	// No cold boot as it would not allow to reboot in bootloader
 	sync();
 	ui_print("REBOOT in BOOTLOADER...\n");
@@ -630,19 +691,19 @@ void libintel_droidboot_init(void)
 	ret |= aboot_register_flash_cmd(ANDROID_OS_NAME, flash_android_kernel);
 	ret |= aboot_register_flash_cmd(RECOVERY_OS_NAME, flash_recovery_kernel);
 	ret |= aboot_register_flash_cmd(FASTBOOT_OS_NAME, flash_fastboot_kernel);
-	ret |= aboot_register_flash_cmd(BOOTLOADER_NAME, flash_bootloader);
+	ret |= aboot_register_flash_cmd(BOOTLOADER_NAME, timed_flash_bootloader);
 	ret |= aboot_register_flash_cmd(ESP_PART_NAME, flash_esp);
 	ret |= aboot_register_flash_cmd(SPLASHSCREEN_NAME, flash_splashscreen_image1);
 	ret |= aboot_register_flash_cmd(SPLASHSCREEN_NAME1, flash_splashscreen_image1);
 	ret |= aboot_register_flash_cmd(SPLASHSCREEN_NAME2, flash_splashscreen_image2);
 	ret |= aboot_register_flash_cmd(SPLASHSCREEN_NAME3, flash_splashscreen_image3);
 	ret |= aboot_register_flash_cmd(SPLASHSCREEN_NAME4, flash_splashscreen_image4);
-	ret |= aboot_register_flash_cmd("dnx", flash_dnx);
-	ret |= aboot_register_flash_cmd("ifwi", flash_ifwi);
-	ret |= aboot_register_flash_cmd("token_umip", flash_token_umip);
-	ret |= aboot_register_flash_cmd("capsule", flash_capsule);
-	ret |= aboot_register_flash_cmd("ulpmc", flash_ulpmc);
-	ret |= aboot_register_flash_cmd("esp_update", flash_esp_update);
+	ret |= aboot_register_flash_cmd("dnx", timed_flash_dnx);
+	ret |= aboot_register_flash_cmd("ifwi", timed_flash_ifwi);
+	ret |= aboot_register_flash_cmd("token_umip", timed_flash_token_umip);
+	ret |= aboot_register_flash_cmd("capsule", timed_flash_capsule);
+	ret |= aboot_register_flash_cmd("ulpmc", timed_flash_ulpmc);
+	ret |= aboot_register_flash_cmd("esp_update", timed_flash_esp_update);
 	ret |= aboot_register_flash_cmd(SILENT_BINARY_NAME, flash_silent_binary);
 
 	if (strcmp(build_type_prop, "user")) {
@@ -650,20 +711,24 @@ void libintel_droidboot_init(void)
 		ret |= aboot_register_oem_cmd("custom_boot" , oem_custom_boot);
 		ret |= aboot_register_oem_cmd("erase_token", oem_erase_token);
 	}
-	ret |= aboot_register_oem_cmd("erase", oem_erase_partition);
-	ret |= aboot_register_oem_cmd("repart", oem_repart_partition);
+	ret |= aboot_register_oem_cmd("erase", timed_oem_erase_partition);
+	ret |= aboot_register_oem_cmd("repart", timed_oem_repart_partition);
 
-	ret |= aboot_register_oem_cmd("write_osip_header", oem_write_osip_header);
-	ret |= aboot_register_oem_cmd("erase_osip_header", oem_erase_osip_header);
+	ret |= aboot_register_oem_cmd("write_osip_header", timed_oem_write_osip_header);
+	ret |= aboot_register_oem_cmd("erase_osip_header", timed_oem_erase_osip_header);
 	ret |= aboot_register_oem_cmd("start_partitioning", oem_partition_start_handler);
-	ret |= aboot_register_oem_cmd("partition", oem_partition_cmd_handler);
-	ret |= aboot_register_oem_cmd("retrieve_partitions", oem_retrieve_partitions);
+	ret |= aboot_register_oem_cmd("partition", timed_oem_partition_cmd_handler);
+	ret |= aboot_register_oem_cmd("retrieve_partitions", timed_oem_retrieve_partitions);
 	ret |= aboot_register_oem_cmd("stop_partitioning", oem_partition_stop_handler);
 	ret |= aboot_register_oem_cmd("get_batt_info", oem_get_batt_info_handler);
 	ret |= aboot_register_oem_cmd("reboot", oem_reboot);
-	ret |= aboot_register_oem_cmd("wipe", oem_wipe_partition);
+	ret |= aboot_register_oem_cmd("wipe", timed_oem_wipe_partition);
+	ret |= aboot_register_oem_cmd("erase_status", oem_erase_status);
 	ret |= aboot_register_oem_cmd("config", oem_config);
 	ret |= aboot_register_oem_cmd("mount", oem_mount);
+	ret |= aboot_register_oem_cmd("backends", oem_backends);
+	ret |= aboot_register_oem_cmd("perf", oem_perf);
+	ret |= aboot_register_oem_cmd("smart_flash", oem_smart_flash);
 
 #ifdef TEE_FRAMEWORK
 	print_fun = fastboot_info;
@@ -686,8 +751,8 @@ void libintel_droidboot_init(void)
 
 	ret |= aboot_register_flash_cmd(RAMDUMP_OS_NAME, flash_ramdump);
 
-	ret |= aboot_register_oem_cmd("backup_factory", oem_backup_factory);
-	ret |= aboot_register_oem_cmd("restore_factory", oem_restore_factory);
+	ret |= aboot_register_oem_cmd("backup_factory", timed_oem_backup_factory);
+	ret |= aboot_register_oem_cmd("restore_factory", timed_oem_restore_factory);
 	ret |= aboot_register_oem_cmd("fastboot2adb", oem_fastboot2adb);
 #endif
 
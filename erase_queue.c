@@ -0,0 +1,274 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "erase_queue.h"
+#include "util.h"
+
+enum job_state {
+	JOB_QUEUED,
+	JOB_RUNNING,
+	JOB_DONE,
+	JOB_FAILED
+};
+
+static const char *const state_names[] = {
+	[JOB_QUEUED] = "queued",
+	[JOB_RUNNING] = "erasing",
+	[JOB_DONE] = "done",
+	[JOB_FAILED] = "failed",
+};
+
+struct erase_job {
+	struct erase_job *next;
+	char *name;
+	char *arg;
+	erase_fn fn;
+	enum job_state state;
+	time_t start;
+	time_t end;
+};
+
+/* Jobs in submission order. Finished ones are kept for
+ * erase_queue_status() until the same partition is queued again. The
+ * worker is the only one to run jobs, and finished jobs are the only ones
+ * ever freed, so it reads the running job without the lock. queue_changed
+ * is broadcast on every new job and every job completion. */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_changed = PTHREAD_COND_INITIALIZER;
+static struct erase_job *jobs;
+static bool worker_started;
+
+static time_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static bool job_pending(const struct erase_job *job)
+{
+	return job->state == JOB_QUEUED || job->state == JOB_RUNNING;
+}
+
+/* key is NULL to match every job */
+static bool job_matches(const struct erase_job *job, const char *key)
+{
+	return !key || !strcmp(job->name, key);
+}
+
+/**
+ * Turns a partition name into the mount point the volume tables know it
+ * by: "userdata" is "/data", other names get a leading '/', and mount
+ * points are kept as they are.
+ *
+ * @return 0 if successful
+ * @return -1 if the mount point does not fit in size bytes
+ */
+int erase_queue_key(const char *name, char *key, size_t size)
+{
+	int len;
+
+	if (name[0] == '/')
+		len = snprintf(key, size, "%s", name);
+	else if (!strcmp(name, "userdata"))
+		len = snprintf(key, size, "/data");
+	else
+		len = snprintf(key, size, "/%s", name);
+
+	return len < 0 || (size_t)len >= size ? -1 : 0;
+}
+
+static void job_free(struct erase_job *job)
+{
+	free(job->name);
+	free(job->arg);
+	free(job);
+}
+
+static void *erase_worker(void *arg)
+{
+	struct erase_job *job;
+	int ret;
+
+	util_background_thread();
+
+	pthread_mutex_lock(&queue_lock);
+	for (;;) {
+		for (job = jobs; job && job->state != JOB_QUEUED; job = job->next) ;
+		if (!job) {
+			pthread_cond_wait(&queue_changed, &queue_lock);
+			continue;
+		}
+
+		job->state = JOB_RUNNING;
+		job->start = now();
+		pthread_mutex_unlock(&queue_lock);
+
+		print("background erase of %s started\n", job->name);
+		ret = job->fn(job->arg);
+		print("background erase of %s %s\n", job->name, ret ? "failed" : "done");
+
+		pthread_mutex_lock(&queue_lock);
+		job->state = ret ? JOB_FAILED : JOB_DONE;
+		job->end = now();
+		pthread_cond_broadcast(&queue_changed);
+	}
+	return NULL;
+}
+
+/* Called with queue_lock held */
+static bool start_worker(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	if (worker_started)
+		return true;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	worker_started = !pthread_create(&thread, &attr, erase_worker, NULL);
+	pthread_attr_destroy(&attr);
+	return worker_started;
+}
+
+/**
+ * Queues fn(arg), the erase of partition name, behind the erases already
+ * queued. If the worker thread can't be started, fn runs right away.
+ *
+ * @return 0 if the job is queued, or ran and succeeded
+ * @return -1 otherwise
+ */
+int erase_queue_add(const char *name, erase_fn fn, const char *arg)
+{
+	struct erase_job **p, *job;
+	char key[ERASE_KEY_LEN];
+
+	if (erase_queue_key(name, key, sizeof(key))) {
+		error("Can't queue the erase of %s: name too long\n", name);
+		return -1;
+	}
+
+	job = calloc(1, sizeof(*job));
+	if (!job || !(job->name = strdup(key)) || !(job->arg = strdup(arg))) {
+		error("Can't queue the erase of %s: out of memory\n", name);
+		if (job)
+			job_free(job);
+		return -1;
+	}
+	job->fn = fn;
+	job->state = JOB_QUEUED;
+
+	pthread_mutex_lock(&queue_lock);
+	if (!start_worker()) {
+		pthread_mutex_unlock(&queue_lock);
+		job_free(job);
+		error("Can't start the erase worker, erasing %s now\n", name);
+		return fn(arg);
+	}
+
+	/* Forget the previous erases of this partition */
+	for (p = &jobs; *p;) {
+		if (!job_pending(*p) && job_matches(*p, key)) {
+			struct erase_job *old = *p;
+
+			*p = old->next;
+			job_free(old);
+		} else
+			p = &(*p)->next;
+	}
+	*p = job;
+	pthread_cond_broadcast(&queue_changed);
+	pthread_mutex_unlock(&queue_lock);
+
+	print("erase of %s queued\n", key);
+	return 0;
+}
+
+/* Waits for the queued erases of partition name to be over, or for all
+ * of them if name is NULL. */
+void erase_queue_wait(const char *name)
+{
+	struct erase_job *job;
+	char key[ERASE_KEY_LEN];
+
+	/* Nothing can be queued under a name too long for a key */
+	if (name && erase_queue_key(name, key, sizeof(key)))
+		return;
+
+	pthread_mutex_lock(&queue_lock);
+	for (;;) {
+		for (job = jobs; job; job = job->next)
+			if (job_pending(job) && job_matches(job, name ? key : NULL))
+				break;
+		if (!job)
+			break;
+		pthread_cond_wait(&queue_changed, &queue_lock);
+	}
+	pthread_mutex_unlock(&queue_lock);
+}
+
+/**
+ * Reports the state of the erases of partition name, or of all the
+ * erases if name is NULL, one line per job.
+ *
+ * @return 0 if none of them failed
+ * @return -1 if one did, or if name was never queued
+ */
+int erase_queue_status(const char *name, void (*out) (const char *line))
+{
+	struct erase_job *job;
+	char key[ERASE_KEY_LEN] = "";
+	char line[64];
+	int ret = 0;
+	bool found = false;
+
+	if (name && erase_queue_key(name, key, sizeof(key)))
+		key[0] = '\0';
+
+	pthread_mutex_lock(&queue_lock);
+	for (job = jobs; job; job = job->next) {
+		if (!job_matches(job, name ? key : NULL))
+			continue;
+		found = true;
+		if (job->state == JOB_QUEUED)
+			snprintf(line, sizeof(line), "%s: %s", job->name, state_names[job->state]);
+		else
+			snprintf(line, sizeof(line), "%s: %s, %lu s", job->name, state_names[job->state],
+				 (unsigned long)((job_pending(job) ? now() : job->end) - job->start));
+		out(line);
+		if (job->state == JOB_FAILED)
+			ret = -1;
+	}
+	pthread_mutex_unlock(&queue_lock);
+
+	if (!found && name) {
+		snprintf(line, sizeof(line), "%s: never queued", name);
+		out(line);
+		ret = -1;
+	} else if (!found)
+		out("no erase queued");
+
+	return ret;
+}
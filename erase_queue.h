@@ -0,0 +1,36 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _ERASE_QUEUE_H_
+#define _ERASE_QUEUE_H_
+
+#include <stddef.h>
+
+/* Erases run one after the other on a worker thread, while the commands
+ * that follow go on. A job is keyed by the mount point of the partition
+ * it erases, and every partition name given to these functions is first
+ * turned into that key with erase_queue_key(). */
+typedef int (*erase_fn) (const char *arg);
+
+#define ERASE_KEY_LEN	50
+
+int erase_queue_key(const char *name, char *key, size_t size);
+
+int erase_queue_add(const char *name, erase_fn fn, const char *arg);
+void erase_queue_wait(const char *name);
+int erase_queue_status(const char *name, void (*out) (const char *line));
+
+#endif	/* _ERASE_QUEUE_H_ */
@@ -14,14 +14,18 @@
  * limitations under the License.
  */
 
+#include <string.h>
+
+#include "erase_queue.h"
 #include "flash.h"
 #include "flash_ops.h"
+#include "perf.h"
 #include "util.h"
 
-static void *o;
-
-#define ops_call(op, func, ...) \
-	(o = op##_ops()) && ((struct op##_operations *)o)->func ? ((struct op##_operations *)o)->func(__VA_ARGS__) : stub_operation(#func)
+#define ops_call(op, func, ...) ({					\
+	struct op##_operations *o = op##_ops();				\
+	o && o->func ? o->func(__VA_ARGS__) : stub_operation(#func);	\
+})
 
 int flash_dnx_timeout(void *data, size_t size)
 {
@@ -80,7 +84,13 @@ int flash_capsule(void *data, unsigned sz)
 
 int flash_image(void *data, unsigned sz, const char *name)
 {
-	return ops_call(bootimage, flash_image, data, sz, name);
+	int ret;
+
+	perf_begin(name);
+	erase_queue_wait(name);
+	ret = ops_call(bootimage, flash_image, data, sz, name);
+	perf_end(ret);
+	return ret;
 }
 
 int read_image(const char *name, void **data)
@@ -88,6 +98,28 @@ int read_image(const char *name, void **data)
 	return ops_call(bootimage, read_image, name, data);
 }
 
+/* Backends without a map_image operation hand out a heap copy from
+ * read_image, which unmap_image frees. */
+int map_image(const char *name, void **data)
+{
+	struct bootimage_operations *ops = bootimage_ops();
+
+	if (ops && ops->map_image)
+		return ops->map_image(name, data);
+
+	return read_image(name, data);
+}
+
+void unmap_image(void *data, int size)
+{
+	struct bootimage_operations *ops = bootimage_ops();
+
+	if (ops && ops->unmap_image)
+		ops->unmap_image(data, size);
+	else
+		free(data);
+}
+
 int read_image_signature(void **buf, char *name)
 {
 	return ops_call(bootimage, read_image_signature, buf, name);
@@ -153,3 +185,16 @@ int flash_ramdump(void *data, unsigned sz)
 	return flash_image(data, sz, RAMDUMP_OS_NAME);
 }
 
+
+/* oem smart_flash <on|off> */
+int oem_smart_flash(int argc, char **argv)
+{
+	if (argc != 2 || (strcmp(argv[1], "on") && strcmp(argv[1], "off"))) {
+		error("Usage: smart_flash <on|off>\n");
+		return -1;
+	}
+
+	set_smart_flash(!strcmp(argv[1], "on"));
+	print("Smart flash %s\n", argv[1]);
+	return 0;
+}
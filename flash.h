@@ -17,6 +17,7 @@
 #ifndef _FLASH_H_
 #define _FLASH_H_
 
+#include <stdint.h>
 #include <sys/types.h>
 
 #define ANDROID_OS_NAME     "boot"
@@ -53,8 +54,18 @@ int read_dnx_timeout(void);
 
 int flash_image(void *data, unsigned sz, const char *name);
 int read_image(const char *name, void **data);
+int map_image(const char *name, void **data);
+void unmap_image(void *data, int size);
 int read_image_signature(void **buf, char *name);
 int get_device_path(char **path, const char *name);
+
+struct device_info {
+	dev_t dev;
+	uint64_t size;			/* in bytes */
+	unsigned int sector_size;
+};
+int get_device_info(const char *name, struct device_info *info);
+void invalidate_device_cache(void);
 int flash_android_kernel(void *data, unsigned sz);
 int flash_recovery_kernel(void *data, unsigned sz);
 int flash_fastboot_kernel(void *data, unsigned sz);
@@ -67,6 +78,7 @@ int flash_esp(void *data, unsigned sz);
 int flash_testos(void *data, unsigned sz);
 int flash_silent_binary();
 int flash_bootloader(void *data, unsigned sz);
+int oem_smart_flash(int argc, char **argv);
 
 /* Returns:
  * -1: error
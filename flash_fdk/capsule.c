@@ -24,13 +24,13 @@
 #include "util.h"
 #include "capsule.h"
 #include "flash.h"
+#include "verify.h"
 
 #define CAPSULE_PARTITION_LABEL "FWUP"
 #define CAPSULE_UPDATE_FLAG_PATH "/sys/firmware/osnib/fw_update"
 
 #define CAPSULE_HEADER "capsule header "
 #define MN2_VER_BYTESREORDER(data) data[1]<< 24 | data[0] << 16 | data[3] << 8 | data[2];
-#define CAPSULE_FW_VERSION_TAG 0x244d4e32	/* $MN2 */
 /* Offset in byte to apply from the last $MN2 TAG byte to found the version value */
 #define CAPSULE_FW_VERSION_OFFSET 5
 
@@ -44,16 +44,26 @@ bool is_fdk(void)
 	return !!path;
 }
 
+static const char *const mn2_tags[] = { "$MN2" };
+
+static int first_tag_fn(size_t offset, int tag, void *cookie)
+{
+	*(size_t *)cookie = offset;
+	return 1;
+}
+
 static bool get_fw_version_tag_offset(u8 ** data_ptr, u8 * end_ptr)
 {
-	u32 patt = 0;
+	size_t offset;
 
-	for (; *data_ptr < end_ptr; (*data_ptr)++) {
-		patt = patt << 8 | **data_ptr;
-		if (patt == CAPSULE_FW_VERSION_TAG) {
-			*data_ptr += CAPSULE_FW_VERSION_OFFSET;
-			return true;
-		}
+	if (*data_ptr >= end_ptr)
+		return false;
+
+	if (scan_tags(*data_ptr, end_ptr - *data_ptr, mn2_tags, ARRAY_SIZE(mn2_tags),
+		      first_tag_fn, &offset)) {
+		/* Version is relative to the last $MN2 byte */
+		*data_ptr += offset + SCAN_TAG_LEN - 1 + CAPSULE_FW_VERSION_OFFSET;
+		return true;
 	}
 
 	/* no $MN2 found return 0 */
@@ -224,7 +234,7 @@ int flash_capsule_fdk(void *data, unsigned sz)
 		goto exit;
 	}
 
-	if ((ret_status = file_write(dev_path, data, sz))) {
+	if ((ret_status = verified_write(dev_path, 0, data, sz))) {
 		error("Capsule flashing failed: %s\n", strerror(errno));
 		goto exit;
 	}
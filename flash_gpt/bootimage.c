@@ -15,56 +15,224 @@
  */
 
 #include <bootimg.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <time.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <linux/fs.h>
 #include "util.h"
 #include "flash.h"
+#include "perf.h"
+#include "verify.h"
 
 #define DISK_BY_LABEL_DIR		"/dev/disk/by-label"
 #define BASE_PLATFORM_INTEL_LABEL	"/dev/block/platform/intel/by-label"
 
-static char *try_prefix(const char *prefix, const char *name)
-{
+static const char *PREFIXES[] = { BY_NAME_DIR, DISK_BY_LABEL_DIR, BASE_PLATFORM_INTEL_LABEL };
+
+/* Partition name to block device cache, filled with a single readdir() of
+ * the first of PREFIXES that exists.  A lookup miss only rescans if that
+ * directory changed since, and invalidate_device_cache() drops everything
+ * when the partition table is re-read. */
+struct device_entry {
+	char *name;
 	char *path;
+	dev_t dev;
+	uint64_t size;			/* in bytes, 0 until asked for */
+	unsigned int sector_size;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	bool valid;
+	const char *prefix;		/* NULL if none exists */
+	time_t mtime;
+	time_t scanned;
+	unsigned int count;
+	struct device_entry *entries;
+} device_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void device_cache_clear(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < device_cache.count; i++) {
+		free(device_cache.entries[i].name);
+		free(device_cache.entries[i].path);
+	}
+	free(device_cache.entries);
+	device_cache.entries = NULL;
+	device_cache.count = 0;
+	device_cache.prefix = NULL;
+	device_cache.valid = false;
+}
+
+static int device_cache_add(const char *prefix, const char *name, dev_t dev)
+{
+	struct device_entry *entries, *e;
+
+	entries = realloc(device_cache.entries, (device_cache.count + 1) * sizeof(*entries));
+	if (!entries)
+		return -1;
+	device_cache.entries = entries;
+
+	e = &entries[device_cache.count];
+	memset(e, 0, sizeof(*e));
+	e->dev = dev;
+	e->name = strdup(name);
+	if (!e->name || asprintf(&e->path, "%s/%s", prefix, name) == -1) {
+		free(e->name);
+		return -1;
+	}
+	device_cache.count++;
+	return 0;
+}
+
+static void device_cache_fill(void)
+{
+	uint64_t start = perf_now();
+	struct dirent *de;
 	struct stat buf;
+	unsigned int i;
+	DIR *dir;
+
+	device_cache_clear();
+	device_cache.valid = true;
+	device_cache.scanned = time(NULL);
 
-	int ret = asprintf(&path, "%s/%s", prefix, name);
-	if (ret == -1) {
-		error("%s: Failed to build %s/%s path\n", prefix, name);
-		return NULL;
+	for (i = 0 ; i < ARRAY_SIZE(PREFIXES) ; i++) {
+		dir = opendir(PREFIXES[i]);
+		if (dir)
+			break;
 	}
+	if (!dir)
+		goto out;
 
-	if (stat(path, &buf) == 0 && S_ISBLK(buf.st_mode))
-		return path;
+	device_cache.prefix = PREFIXES[i];
+	if (fstat(dirfd(dir), &buf) == 0)
+		device_cache.mtime = buf.st_mtime;
+
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+		if (fstatat(dirfd(dir), de->d_name, &buf, 0) || !S_ISBLK(buf.st_mode))
+			continue;
+		if (device_cache_add(device_cache.prefix, de->d_name, buf.st_rdev)) {
+			error("%s: Failed to cache %s/%s\n", __func__, device_cache.prefix, de->d_name);
+			device_cache_clear();
+			break;
+		}
+	}
+	closedir(dir);
+out:
+	perf_add(PERF_PROBE, start, 0);
+}
+
+/* A directory changed in the second it was scanned may have changed after */
+static bool device_cache_stale(void)
+{
+	struct stat buf;
+
+	if (!device_cache.valid || !device_cache.prefix)
+		return true;
+	if (stat(device_cache.prefix, &buf))
+		return true;
+	return buf.st_mtime != device_cache.mtime || buf.st_mtime >= device_cache.scanned;
+}
 
-	free(path);
+/* Must be called with device_cache.lock held */
+static struct device_entry *device_cache_get(const char *name)
+{
+	unsigned int i;
+	bool rescanned = false;
+
+	if (!device_cache.valid) {
+		device_cache_fill();
+		rescanned = true;
+	}
+again:
+	for (i = 0; i < device_cache.count; i++)
+		if (!strcmp(device_cache.entries[i].name, name))
+			return &device_cache.entries[i];
+
+	if (!rescanned && device_cache_stale()) {
+		device_cache_fill();
+		rescanned = true;
+		goto again;
+	}
 	return NULL;
 }
 
-static const char *PREFIXES[] = { BY_NAME_DIR, DISK_BY_LABEL_DIR, BASE_PLATFORM_INTEL_LABEL };
+void invalidate_device_cache(void)
+{
+	pthread_mutex_lock(&device_cache.lock);
+	device_cache_clear();
+	pthread_mutex_unlock(&device_cache.lock);
+}
 
 int get_device_path(char **path, const char *name)
 {
+	struct device_entry *e;
+	int ret = -1;
+
 	if (!name) {
 		error("%s: Passed name is empty.\n", __func__);
 		return -1;
 	}
 
-	unsigned int i;
-	char *tmp;
-	for (i = 0 ; i < ARRAY_SIZE(PREFIXES) ; i++) {
-		tmp = try_prefix(PREFIXES[i], name);
-		if (tmp) {
-			*path = tmp;
-			return 0;
+	pthread_mutex_lock(&device_cache.lock);
+	e = device_cache_get(name);
+	if (e) {
+		*path = strdup(e->path);
+		if (*path)
+			ret = 0;
+		else
+			error("%s: Failed to copy %s path\n", __func__, name);
+	}
+	pthread_mutex_unlock(&device_cache.lock);
+
+	return ret;
+}
+
+int get_device_info(const char *name, struct device_info *info)
+{
+	struct device_entry *e;
+	int ret = -1;
+	int fd;
+
+	pthread_mutex_lock(&device_cache.lock);
+	e = device_cache_get(name);
+	if (!e)
+		goto out;
+
+	if (!e->size) {
+		fd = open(e->path, O_RDONLY);
+		if (fd < 0) {
+			error("Failed to open %s: %s\n", e->path, strerror(errno));
+			goto out;
 		}
+		if (ioctl(fd, BLKGETSIZE64, &e->size) || ioctl(fd, BLKSSZGET, &e->sector_size)) {
+			error("Failed to get %s size: %s\n", e->path, strerror(errno));
+			e->size = 0;
+			close(fd);
+			goto out;
+		}
+		close(fd);
 	}
 
-	return -1;
+	info->dev = e->dev;
+	info->size = e->size;
+	info->sector_size = e->sector_size;
+	ret = 0;
+out:
+	pthread_mutex_unlock(&device_cache.lock);
+	return ret;
 }
 
 bool is_gpt(void)
@@ -79,6 +247,7 @@ bool is_gpt(void)
 
 int flash_image_gpt(void *data, unsigned sz, const char *name)
 {
+	struct device_info info;
 	char *block_dev;
 	int ret;
 
@@ -88,7 +257,15 @@ int flash_image_gpt(void *data, unsigned sz, const char *name)
 	if (get_device_path(&block_dev, name))
 		return -1;
 
-	ret = file_write(block_dev, data, sz);
+	/* Sparse images expand on write, sparse_write() checks them */
+	if (!is_sparse_image(data, sz) && !get_device_info(name, &info) && sz > info.size) {
+		error("%s image (%u bytes) is larger than its partition (%llu bytes)\n",
+		      name, sz, (unsigned long long)info.size);
+		free(block_dev);
+		return -1;
+	}
+
+	ret = verified_write(block_dev, 0, data, sz);
 	free(block_dev);
 	return ret;
 }
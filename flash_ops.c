@@ -22,37 +22,115 @@
 #include "flash_fdk/flash_ops_fdk.h"
 
 #include <stdio.h>
-struct bootimage_operations *bootimage_ops(void)
+
+#include "perf.h"
+
+/* Probing a backend means stats, property lookups or an OSIP read, so
+ * the first backend found is kept for the life of the process.  Failed
+ * probes are not cached: droidboot may be started on a blank eMMC and
+ * only find its backend once the device is partitioned. */
+static struct bootimage_operations *bootimage;
+static struct ifwi_operations *ifwi;
+static struct capsule_operations *capsule;
+static struct flash_backends backends = { "none", "none", "none" };
+
+static struct bootimage_operations *probe_bootimage_ops(void)
 {
-	if (is_gpt())
+	if (is_gpt()) {
+		backends.bootimage = "gpt";
 		return &gpt_bootimage_operations;
+	}
 
-	if (is_osip())
+	if (is_osip()) {
+		backends.bootimage = "osip";
 		return &osip_bootimage_operations;
+	}
 
 	return NULL;
 }
 
-struct ifwi_operations *ifwi_ops(void)
+static struct ifwi_operations *probe_ifwi_ops(void)
 {
 	if (is_scu_ipc()) {
+		backends.ifwi = "scu_ipc";
 		return &scu_ipc_ifwi_operations;
 	}
 
 	if (is_scu_emmc()) {
+		backends.ifwi = "scu_emmc";
 		return &scu_emmc_ifwi_operations;
 	}
 
 	return NULL;
 }
 
-struct capsule_operations *capsule_ops(void)
+static struct capsule_operations *probe_capsule_ops(void)
 {
-	if (is_edk2())
+	if (is_edk2()) {
+		backends.capsule = "edk2";
 		return &edk2_capsule_operations;
+	}
 
-	if (is_fdk())
+	if (is_fdk()) {
+		backends.capsule = "fdk";
 		return &fdk_capsule_operations;
+	}
 
 	return NULL;
 }
+
+struct bootimage_operations *bootimage_ops(void)
+{
+	uint64_t start;
+
+	if (!bootimage) {
+		start = perf_now();
+		bootimage = probe_bootimage_ops();
+		perf_add(PERF_PROBE, start, 0);
+	}
+
+	return bootimage;
+}
+
+struct ifwi_operations *ifwi_ops(void)
+{
+	uint64_t start;
+
+	if (!ifwi) {
+		start = perf_now();
+		ifwi = probe_ifwi_ops();
+		perf_add(PERF_PROBE, start, 0);
+	}
+
+	return ifwi;
+}
+
+struct capsule_operations *capsule_ops(void)
+{
+	uint64_t start;
+
+	if (!capsule) {
+		start = perf_now();
+		capsule = probe_capsule_ops();
+		perf_add(PERF_PROBE, start, 0);
+	}
+
+	return capsule;
+}
+
+void flash_ops_reset(void)
+{
+	bootimage = NULL;
+	ifwi = NULL;
+	capsule = NULL;
+	backends.bootimage = backends.ifwi = backends.capsule = "none";
+}
+
+const struct flash_backends *flash_ops_backends(void)
+{
+	bootimage_ops();
+	ifwi_ops();
+	capsule_ops();
+
+	return &backends;
+}
@@ -29,6 +29,8 @@ static inline int stub_operation(const char *func)
 struct bootimage_operations {
 	int (*flash_image) (void *data, unsigned size, const char *name);
 	int (*read_image) (const char *name, void **data);
+	int (*map_image) (const char *name, void **data);
+	void (*unmap_image) (void *data, int size);
 	int (*read_image_signature) (void **buf, char *name);
 	int (*is_image_signed) (const char *name);
 };
@@ -54,4 +56,15 @@ struct bootimage_operations *bootimage_ops(void);
 struct ifwi_operations *ifwi_ops(void);
 struct capsule_operations *capsule_ops(void);
 
+/* Backends are probed on first use and cached; flash_ops_reset() forgets
+ * them, e.g. once the partition layout changed. */
+struct flash_backends {
+	const char *bootimage;
+	const char *ifwi;
+	const char *capsule;
+};
+
+void flash_ops_reset(void);
+const struct flash_backends *flash_ops_backends(void);
+
 #endif	/* _FLASH_OPS_H_ */
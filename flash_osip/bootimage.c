@@ -50,6 +50,28 @@ int read_image_osip(const char *name, void **data)
 	return size;
 }
 
+int map_image_osip(const char *name, void **data)
+{
+	int index;
+	size_t size;
+
+	index = get_named_osii_index(name, READ_OSIP_HEADER);
+
+	if (check_index_outofbound(index))
+		return -1;
+
+	if (map_osimage_data(data, &size, index)) {
+		error("Failed to map OSIP entry\n");
+		return -1;
+	}
+	return size;
+}
+
+void unmap_image_osip(void *data, int size)
+{
+	unmap_osimage_data(data, size);
+}
+
 int flash_image_osip(void *data, unsigned sz, const char *name)
 {
 	int index;
@@ -24,6 +24,8 @@
 bool is_osip(void);
 int flash_image_osip(void *data, unsigned sz, const char *name);
 int read_image_osip(const char *name, void **data);
+int map_image_osip(const char *name, void **data);
+void unmap_image_osip(void *data, int size);
 int read_image_signature_osip(void **buf, char *name);
 int is_image_signed_osip(const char *name);
 
@@ -44,6 +46,15 @@ int read_image_osip(const char *name, void **data)
 	return stub_operation(__func__);
 };
 
+int map_image_osip(const char *name, void **data)
+{
+	return stub_operation(__func__);
+};
+
+void unmap_image_osip(void *data, int size)
+{
+};
+
 int read_image_signature_osip(void **buf, char *name)
 {
 	return stub_operation(__func__);
@@ -59,6 +70,8 @@ int is_image_signed_osip(const char *name)
 struct bootimage_operations osip_bootimage_operations = {
 	.flash_image = flash_image_osip,
 	.read_image = read_image_osip,
+	.map_image = map_image_osip,
+	.unmap_image = unmap_image_osip,
 	.read_image_signature = read_image_signature_osip,
 	.is_image_signed = is_image_signed_osip,
 };
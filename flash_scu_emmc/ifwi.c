@@ -22,7 +22,9 @@
 #include <fcntl.h>
 #include <cutils/properties.h>
 #include <sys/mman.h>
+#include <pthread.h>
 #include "fw_version_check.h"
+#include "util.h"
 
 
 #define FORCE_RW_OPT "0"
@@ -109,15 +111,31 @@ int check_ifwi_file_scu_emmc(void *data, size_t size)
 	return 1;
 }
 
+/* XOR of the 32-bit words of [ptr, ptr + size), size being a multiple of 4.
+ * Works on 64-bit words with independent accumulators so the compiler can
+ * vectorize it, then folds the result back to 32 bits. The loads go through
+ * memcpy() as the callers update the same area with 32-bit stores. */
 static uint32_t xor_compute(char *ptr, uint32_t size)
 {
-	uint32_t xor = 0;
+	uint64_t x[4] = { 0, 0, 0, 0 };
+	uint64_t w[4];
+	uint32_t tail;
 	uint32_t i;
 
-	for (i = 0; i < size; i+=4)
-		xor = xor ^ *(uint32_t *)(ptr + i);
+	for (i = 0; i + sizeof(w) <= size; i += sizeof(w)) {
+		memcpy(w, ptr + i, sizeof(w));
+		x[0] ^= w[0];
+		x[1] ^= w[1];
+		x[2] ^= w[2];
+		x[3] ^= w[3];
+	}
+	for (; i < size; i += sizeof(tail)) {
+		memcpy(&tail, ptr + i, sizeof(tail));
+		x[0] ^= tail;
+	}
 
-	return xor;
+	x[0] ^= x[1] ^ x[2] ^ x[3];
+	return (uint32_t)x[0] ^ (uint32_t)(x[0] >> 32);
 }
 
 static uint8_t xor_factorize(uint32_t xor)
@@ -141,93 +159,240 @@ static void xor_update(char *ptr)
 	xor = xor_compute(ptr, BOOT_UMIP_SIZE);
 	*(ptr + BOOT_UMIP_XOR_OFFSET) = xor_factorize(xor);
 
-	/* update IFWI xor */
+	/* update IFWI xor, reusing the UMIP part computed above */
+	xor ^= (uint32_t)(uint8_t)*(ptr + BOOT_UMIP_XOR_OFFSET) << 24;
 	*(uint32_t *)(ptr + BOOT_IFWI_XOR_OFFSET) = 0x0;
-	xor = xor_compute(ptr, BOOT_IFWI_SIZE);
+	xor ^= xor_compute(ptr + BOOT_UMIP_SIZE, BOOT_IFWI_SIZE - BOOT_UMIP_SIZE);
 	*(uint32_t *)(ptr + BOOT_IFWI_XOR_OFFSET) = xor;
 }
 
-static int write_umip_emmc(uint32_t addr_offset, void *data, size_t size)
+/* XOR of the words touched by a write, split per UMIP sector. Being its
+ * own inverse, XOR lets the checksums be updated from old ^ new of those
+ * words alone instead of being recomputed over the whole boot partition. */
+struct xor_delta {
+	uint32_t sector[BOOT_UMIP_SIZE / BOOT_UMIP_SECTOR_SIZE];
+	uint32_t ifwi;		/* words beyond the UMIP */
+};
+
+/* Sector 0 holds the checksums themselves, writes to it or to the IFWI
+ * xor need a full recompute. */
+static bool xor_delta_allowed(uint32_t offset, size_t size)
 {
-	int boot_fd = 0;
+	uint32_t start = offset & ~3;
+	uint32_t end = (offset + size + 3) & ~3;
+
+	if (start < BOOT_UMIP_SECTOR_SIZE || end > BOOT_IFWI_SIZE)
+		return false;
+
+	return end <= BOOT_IFWI_XOR_OFFSET || start >= BOOT_IFWI_XOR_OFFSET + sizeof(uint32_t);
+}
+
+static void xor_delta_add(char *ptr, uint32_t offset, size_t size, struct xor_delta *delta)
+{
+	uint32_t i;
+	uint32_t end = (offset + size + 3) & ~3;
+
+	for (i = offset & ~3; i < end; i += 4) {
+		if (i < BOOT_UMIP_SIZE)
+			delta->sector[i / BOOT_UMIP_SECTOR_SIZE] ^= *(uint32_t *)(ptr + i);
+		else
+			delta->ifwi ^= *(uint32_t *)(ptr + i);
+	}
+}
+
+/* Fold the old ^ new words of a write into the checksums. This assumes
+ * they were consistent before the write, as left by xor_update(). */
+static void xor_update_delta(char *ptr, struct xor_delta *delta)
+{
+	uint16_t i;
+	uint32_t umip;
+	uint8_t old_xor = *(ptr + BOOT_UMIP_XOR_OFFSET);
+
+	/* update UMIP xor of the sectors touched */
+	for (i = 2; i < 128; i++)
+		*(uint32_t *)(ptr + 4 * i) ^= delta->sector[i];
+
+	/* Each sector word changed exactly like its sector data, so both
+	 * cancel out in the UMIP xor: only sector 1 has no word of its own */
+	umip = delta->sector[1];
+
+	/* update UMIP xor */
+	*(ptr + BOOT_UMIP_XOR_OFFSET) ^= xor_factorize(umip);
+
+	/* update IFWI xor, which also covers the UMIP xor byte */
+	umip ^= (uint32_t)(uint8_t)(old_xor ^ *(ptr + BOOT_UMIP_XOR_OFFSET)) << 24;
+	*(uint32_t *)(ptr + BOOT_IFWI_XOR_OFFSET) ^= umip ^ delta->ifwi;
+}
+
+/* One boot partition copy updated by write_umip_emmc() */
+struct umip_write {
 	int boot_index;
-	char boot_partition[64];
-	char boot_partition_force_ro[64];
+	uint32_t addr_offset;
+	void *data;
+	size_t size;
+	char partition[64];
 	char *ptr;
-	char *token_data;
+	int fd;
+	int ret;
+};
 
-	if (addr_offset == IFWI_OFFSET) {
-		token_data = malloc(TOKEN_UMIP_AREA_SIZE);
-		if (!token_data) {
-			fprintf(stderr, "write_umip_emmc: Malloc error\n");
-			return -1;
-		}
+static void *write_umip_boot(void *arg)
+{
+	struct umip_write *w = arg;
+	char force_ro[64];
+	char token_data[TOKEN_UMIP_AREA_SIZE];
+	struct xor_delta delta;
+	bool incremental;
+
+	snprintf(w->partition, sizeof(w->partition), "/dev/block/mmcblk0boot%d", w->boot_index);
+	snprintf(force_ro, sizeof(force_ro), "/sys/block/mmcblk0boot%d/force_ro", w->boot_index);
+
+	if (force_rw(force_ro)) {
+		fprintf(stderr, "write_umip_emmc: unable to force_ro %s\n", w->partition);
+		return NULL;
+	}
+	w->fd = open(w->partition, O_RDWR);
+	if (w->fd < 0) {
+		fprintf(stderr, "write_umip_emmc: failed to open %s\n", w->partition);
+		return NULL;
+	}
 
-		if (size > BOOT_IFWI_SIZE) {
-			fprintf(stderr, "write_umip_emmc: Truncating last %zd bytes from the IFWI\n",
-			(size - BOOT_IFWI_SIZE));
-			/* Since the last 144 bytes are the FUP header which are not required,*/
-			/* we truncate it to fit into the boot partition. */
-			size = BOOT_IFWI_SIZE;
-		}
+	w->ptr = (char *)mmap(NULL, BOOT_IFWI_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, w->fd, 0);
+	if (w->ptr == MAP_FAILED) {
+		fprintf(stderr, "write_umip_emmc: mmap failed on boot%d with error : %s\n", w->boot_index, strerror(errno));
+		return NULL;
 	}
 
-	for (boot_index = 0; boot_index < 2; boot_index++) {
-		snprintf(boot_partition, 64, "/dev/block/mmcblk0boot%d", boot_index);
-		snprintf(boot_partition_force_ro, 64, "/sys/block/mmcblk0boot%d/force_ro", boot_index);
+	if (w->addr_offset == IFWI_OFFSET)
+		memcpy(token_data, w->ptr + TOKEN_UMIP_AREA_OFFSET, TOKEN_UMIP_AREA_SIZE);
 
-		if (force_rw(boot_partition_force_ro)) {
-			fprintf(stderr, "write_umip_emmc: unable to force_ro %s\n", boot_partition);
-			goto err_boot1;
-		}
-		boot_fd = open(boot_partition, O_RDWR);
-		if (boot_fd < 0) {
-			fprintf(stderr, "write_umip_emmc: failed to open %s\n", boot_partition);
-			goto err_boot1;
-		}
+	incremental = w->addr_offset != IFWI_OFFSET && xor_delta_allowed(w->addr_offset, w->size);
+	if (incremental) {
+		memset(&delta, 0, sizeof(delta));
+		xor_delta_add(w->ptr, w->addr_offset, w->size, &delta);
+	}
 
-		ptr = (char *)mmap(NULL, BOOT_IFWI_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, boot_fd, 0);
-		if (ptr == MAP_FAILED) {
-			fprintf(stderr, "write_umip_emmc: mmap failed on boot%d with error : %s\n", boot_index, strerror(errno));
-			goto err_boot1;
-		}
+	/* Write the data */
+	if (w->data == NULL)
+		memset(w->ptr + w->addr_offset, 0, w->size);
+	else
+		memcpy(w->ptr + w->addr_offset, w->data, w->size);
+
+	if (w->addr_offset == IFWI_OFFSET)
+		memcpy(w->ptr + TOKEN_UMIP_AREA_OFFSET, token_data, TOKEN_UMIP_AREA_SIZE);
+
+	/* Compute and write xor */
+	if (incremental) {
+		xor_delta_add(w->ptr, w->addr_offset, w->size, &delta);
+		xor_update_delta(w->ptr, &delta);
+	} else
+		xor_update(w->ptr);
+
+	if (msync(w->ptr, BOOT_IFWI_SIZE, MS_SYNC)) {
+		fprintf(stderr, "write_umip_emmc: msync failed on boot%d with error : %s\n", w->boot_index, strerror(errno));
+		return NULL;
+	}
+
+	w->ret = 0;
+	return NULL;
+}
 
-		if (addr_offset == IFWI_OFFSET)
-			memcpy(token_data, ptr + TOKEN_UMIP_AREA_OFFSET, TOKEN_UMIP_AREA_SIZE);
-
-		/* Write the data */
-		if (addr_offset + size <= BOOT_IFWI_SIZE)
-			if (data == NULL)
-				memset(ptr + addr_offset, 0, size);
-			else
-				memcpy(ptr + addr_offset, data, size);
-		else {
-			fprintf(stderr, "write_umip_emmc: write failed\n");
-			goto err_boot2;
+/* Read back from the device the sectors just written (data and xor) and
+ * check they hold what was put in the mapping. */
+static int verify_umip_boot(struct umip_write *w)
+{
+	uint32_t range[3][2] = {
+		{ 0, BOOT_UMIP_SECTOR_SIZE },
+		{ BOOT_IFWI_XOR_OFFSET & ~(BOOT_UMIP_SECTOR_SIZE - 1), BOOT_UMIP_SECTOR_SIZE },
+		{ w->addr_offset & ~(BOOT_UMIP_SECTOR_SIZE - 1), 0 },
+	};
+	char *buf = NULL;
+	int ret = -1;
+	int fd;
+	int i;
+
+	range[2][1] = ((w->addr_offset + w->size + BOOT_UMIP_SECTOR_SIZE - 1) & ~(BOOT_UMIP_SECTOR_SIZE - 1)) - range[2][0];
+
+	fd = open(w->partition, O_RDONLY | O_DIRECT);
+	if (fd < 0 || posix_memalign((void **)&buf, 4096, range[2][1] > BOOT_UMIP_SECTOR_SIZE ? range[2][1] : BOOT_UMIP_SECTOR_SIZE)) {
+		fprintf(stderr, "write_umip_emmc: can't read back %s\n", w->partition);
+		goto out;
+	}
+
+	for (i = 0; i < 3; i++) {
+		if (safe_pread(fd, buf, range[i][1], range[i][0]) ||
+		    memcmp(buf, w->ptr + range[i][0], range[i][1])) {
+			fprintf(stderr, "write_umip_emmc: read back check failed on %s at 0x%x\n",
+				w->partition, range[i][0]);
+			goto out;
 		}
+	}
+	ret = 0;
+
+out:
+	free(buf);
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
 
-		if (addr_offset == IFWI_OFFSET)
-			memcpy(ptr + TOKEN_UMIP_AREA_OFFSET, token_data, TOKEN_UMIP_AREA_SIZE);
+/* Both boot partitions are updated concurrently, each on its own thread,
+ * then read back. Ending up with only one of them updated is reported as
+ * such since the two copies are then out of sync. */
+static int write_umip_emmc(uint32_t addr_offset, void *data, size_t size)
+{
+	struct umip_write w[2];
+	pthread_t thread[2];
+	bool threaded[2];
+	int i;
+
+	if (addr_offset == IFWI_OFFSET && size > BOOT_IFWI_SIZE) {
+		fprintf(stderr, "write_umip_emmc: Truncating last %zd bytes from the IFWI\n",
+		(size - BOOT_IFWI_SIZE));
+		/* Since the last 144 bytes are the FUP header which are not required,*/
+		/* we truncate it to fit into the boot partition. */
+		size = BOOT_IFWI_SIZE;
+	}
 
-		/* Compute and write xor */
-		xor_update(ptr);
+	if (addr_offset + size > BOOT_IFWI_SIZE) {
+		fprintf(stderr, "write_umip_emmc: write failed\n");
+		return -1;
+	}
 
-		munmap(ptr, BOOT_IFWI_SIZE);
-		close(boot_fd);
+	for (i = 0; i < 2; i++) {
+		memset(&w[i], 0, sizeof(w[i]));
+		w[i].boot_index = i;
+		w[i].addr_offset = addr_offset;
+		w[i].data = data;
+		w[i].size = size;
+		w[i].ptr = MAP_FAILED;
+		w[i].fd = -1;
+		w[i].ret = -1;
+
+		threaded[i] = !pthread_create(&thread[i], NULL, write_umip_boot, &w[i]);
+		if (!threaded[i])
+			write_umip_boot(&w[i]);
 	}
 
-	if (addr_offset == IFWI_OFFSET)
-		free(token_data);
-	return 0;
+	for (i = 0; i < 2; i++) {
+		if (threaded[i])
+			pthread_join(thread[i], NULL);
+	}
 
-err_boot2:
-	munmap(ptr, BOOT_IFWI_SIZE);
+	for (i = 0; i < 2; i++) {
+		if (!w[i].ret)
+			w[i].ret = verify_umip_boot(&w[i]);
+		if (w[i].ptr != MAP_FAILED)
+			munmap(w[i].ptr, BOOT_IFWI_SIZE);
+		if (w[i].fd >= 0)
+			close(w[i].fd);
+	}
 
-err_boot1:
-	if (addr_offset == IFWI_OFFSET)
-		free(token_data);
-	close(boot_fd);
-	return -1;
+	if (w[0].ret != w[1].ret)
+		fprintf(stderr, "write_umip_emmc: boot%d updated but not boot%d, boot partitions are out of sync!\n",
+			w[0].ret ? 1 : 0, w[0].ret ? 0 : 1);
+
+	return w[0].ret || w[1].ret ? -1 : 0;
 }
 
 static int readbyte_umip_emmc(uint32_t addr_offset)
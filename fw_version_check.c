@@ -26,6 +26,7 @@
 #include <stdint.h>
 
 #include "fw_version_check.h"
+#include "util.h"
 
 #define DEVICE_NAME	"/sys/devices/ipc/intel_fw_update.0/fw_info/fw_version"
 #define DEVICE_NAME_ALT	"/sys/kernel/fw_update/fw_info/fw_version"
@@ -307,158 +308,161 @@ void dump_fw_versions(struct firmware_versions *v)
 	printf("   chaabi ext: %02X.%02X\n", v->chaabi_ext.major, v->chaabi_ext.minor);
 }
 
-int get_image_fw_rev(void *data, unsigned sz, struct firmware_versions *v)
-{
-	struct FIP_header fip;
-	unsigned char *databytes = (unsigned char *)data;
-	int magic;
-	int magic_found = 0;
+static const char *const fip_tags[] = { "$FIP" };
 
-	if (v == NULL) {
-		fprintf(stderr, "Null pointer !\n");
-		return -1;
-	} else
-		memset((void *)v, 0, sizeof(struct firmware_versions));
+struct fip_scan {
+	const unsigned char *data;
+	size_t size;
+	size_t header_size;
+	void (*apply) (const void *header, void *v);
+	void *v;
+	int found;
+};
 
-	while (sz >= sizeof(fip)) {
+static void apply_fip(const void *header, void *versions)
+{
+	struct firmware_versions *v = versions;
+	struct FIP_header fip_header;
+	const struct FIP_header *fip = &fip_header;
+
+	memcpy(&fip_header, header, sizeof(fip_header));
+
+	/* don't update if null */
+	if (fip->ifwi_rev.major != 0)
+		v->ifwi.major = fip->ifwi_rev.major;
+	if (fip->ifwi_rev.minor != 0)
+		v->ifwi.minor = fip->ifwi_rev.minor;
+	if (fip->scu_rev.major != 0)
+		v->scu.major = fip->scu_rev.major;
+	if (fip->scu_rev.minor != 0)
+		v->scu.minor = fip->scu_rev.minor;
+	if (fip->oem_rev.major != 0)
+		v->oem.major = fip->oem_rev.major;
+	if (fip->oem_rev.minor != 0)
+		v->oem.minor = fip->oem_rev.minor;
+	if (fip->punit_rev.major != 0)
+		v->punit.major = fip->punit_rev.major;
+	if (fip->punit_rev.minor != 0)
+		v->punit.minor = fip->punit_rev.minor;
+	if (fip->ia32_rev.major != 0)
+		v->ia32.major = fip->ia32_rev.major;
+	if (fip->ia32_rev.minor != 0)
+		v->ia32.minor = fip->ia32_rev.minor;
+	if (fip->suppia32_rev.major != 0)
+		v->supp_ia32.major = fip->suppia32_rev.major;
+	if (fip->suppia32_rev.minor != 0)
+		v->supp_ia32.minor = fip->suppia32_rev.minor;
+	if (fip->chaabi_rev.icache.major != 0)
+		v->chaabi_icache.major = fip->chaabi_rev.icache.major;
+	if (fip->chaabi_rev.icache.minor != 0)
+		v->chaabi_icache.minor = fip->chaabi_rev.icache.minor;
+	if (fip->chaabi_rev.resident.major != 0)
+		v->chaabi_res.major = fip->chaabi_rev.resident.major;
+	if (fip->chaabi_rev.resident.minor != 0)
+		v->chaabi_res.minor = fip->chaabi_rev.resident.minor;
+	if (fip->chaabi_rev.ext.major != 0)
+		v->chaabi_ext.major = fip->chaabi_rev.ext.major;
+	if (fip->chaabi_rev.ext.minor != 0)
+		v->chaabi_ext.minor = fip->chaabi_rev.ext.minor;
+}
 
-		/* Scan for the FIP magic */
-		while (sz >= sizeof(fip)) {
-			memcpy(&magic, databytes, sizeof(magic));
-			if (magic == FIP_PATTERN) {
-				magic_found = 1;
-				break;
-			}
-			databytes += sizeof(magic);
-			sz -= sizeof(magic);
-		}
+static void apply_fip_long(const void *header, void *versions)
+{
+	struct firmware_versions_long *v = versions;
+	struct FIP_header_long fip_header;
+	const struct FIP_header_long *fip = &fip_header;
+
+	memcpy(&fip_header, header, sizeof(fip_header));
+
+	/* not available in ifwi file */
+	v->scubootstrap.minor = 0;
+	v->scubootstrap.major = 0;
+
+	/* don't update if null */
+	if (fip->scuc_rev.minor != 0)
+		v->scu.minor = fip->scuc_rev.minor;
+	if (fip->scuc_rev.major != 0)
+		v->scu.major = fip->scuc_rev.major;
+	if (fip->ia32_rev.minor != 0)
+		v->ia32.minor = fip->ia32_rev.minor;
+	if (fip->ia32_rev.major != 0)
+		v->ia32.major = fip->ia32_rev.major;
+	if (fip->oem_rev.minor != 0)
+		v->valhooks.minor = fip->oem_rev.minor;
+	if (fip->oem_rev.major != 0)
+		v->valhooks.major = fip->oem_rev.major;
+	if (fip->ifwi_rev.minor != 0)
+		v->ifwi.minor = fip->ifwi_rev.minor;
+	if (fip->ifwi_rev.major != 0)
+		v->ifwi.major = fip->ifwi_rev.major;
+	if (fip->ch00_rev.minor != 0)
+		v->chaabi.minor = fip->ch00_rev.minor;
+	if (fip->ch00_rev.major != 0)
+		v->chaabi.major = fip->ch00_rev.major;
+	if (fip->mia_rev.minor != 0)
+		v->mia.minor = fip->mia_rev.minor;
+	if (fip->mia_rev.major != 0)
+		v->mia.major = fip->mia_rev.major;
+}
 
-		if (!magic_found) {
-			fprintf(stderr, "Couldn't find FIP magic in image!\n");
-			return -1;
-		}
-		if (sz < sizeof(fip)) {
-			break;
-		}
+/* FIP headers are 32 bit aligned; the ones too close to the end of the
+ * image to hold a whole header are ignored */
+static int fip_scan_fn(size_t offset, int tag, void *cookie)
+{
+	struct fip_scan *s = cookie;
 
-		memcpy(&fip, databytes, sizeof(fip));
-
-		/* don't update if null */
-		if (fip.ifwi_rev.major != 0)
-			v->ifwi.major = fip.ifwi_rev.major;
-		if (fip.ifwi_rev.minor != 0)
-			v->ifwi.minor = fip.ifwi_rev.minor;
-		if (fip.scu_rev.major != 0)
-			v->scu.major = fip.scu_rev.major;
-		if (fip.scu_rev.minor != 0)
-			v->scu.minor = fip.scu_rev.minor;
-		if (fip.oem_rev.major != 0)
-			v->oem.major = fip.oem_rev.major;
-		if (fip.oem_rev.minor != 0)
-			v->oem.minor = fip.oem_rev.minor;
-		if (fip.punit_rev.major != 0)
-			v->punit.major = fip.punit_rev.major;
-		if (fip.punit_rev.minor != 0)
-			v->punit.minor = fip.punit_rev.minor;
-		if (fip.ia32_rev.major != 0)
-			v->ia32.major = fip.ia32_rev.major;
-		if (fip.ia32_rev.minor != 0)
-			v->ia32.minor = fip.ia32_rev.minor;
-		if (fip.suppia32_rev.major != 0)
-			v->supp_ia32.major = fip.suppia32_rev.major;
-		if (fip.suppia32_rev.minor != 0)
-			v->supp_ia32.minor = fip.suppia32_rev.minor;
-		if (fip.chaabi_rev.icache.major != 0)
-			v->chaabi_icache.major = fip.chaabi_rev.icache.major;
-		if (fip.chaabi_rev.icache.minor != 0)
-			v->chaabi_icache.minor = fip.chaabi_rev.icache.minor;
-		if (fip.chaabi_rev.resident.major != 0)
-			v->chaabi_res.major = fip.chaabi_rev.resident.major;
-		if (fip.chaabi_rev.resident.minor != 0)
-			v->chaabi_res.minor = fip.chaabi_rev.resident.minor;
-		if (fip.chaabi_rev.ext.major != 0)
-			v->chaabi_ext.major = fip.chaabi_rev.ext.major;
-		if (fip.chaabi_rev.ext.minor != 0)
-			v->chaabi_ext.minor = fip.chaabi_rev.ext.minor;
-
-		databytes += sizeof(magic);
-		sz -= sizeof(magic);
-	}
+	if (offset % sizeof(uint32_t) || s->size - offset < s->header_size)
+		return 0;
 
+	s->apply(s->data + offset, s->v);
+	s->found = 1;
 	return 0;
 }
 
-int get_image_fw_rev_long(void *data, unsigned sz, struct firmware_versions_long *v)
+/* Every FIP in the image is applied in order, later non null fields
+ * override earlier ones */
+static int scan_fip(void *data, unsigned sz, size_t header_size,
+		    void (*apply) (const void *header, void *v), void *v)
 {
-	struct FIP_header_long fip;
-	unsigned char *databytes = (unsigned char *)data;
-	int magic;
-	int magic_found = 0;
+	struct fip_scan s = {
+		.data = data,
+		.size = sz,
+		.header_size = header_size,
+		.apply = apply,
+		.v = v,
+	};
+
+	if (sz < header_size)
+		return 0;
 
+	scan_tags(data, sz, fip_tags, ARRAY_SIZE(fip_tags), fip_scan_fn, &s);
+	if (!s.found) {
+		fprintf(stderr, "Couldn't find FIP magic in image!\n");
+		return -1;
+	}
+	return 0;
+}
+
+int get_image_fw_rev(void *data, unsigned sz, struct firmware_versions *v)
+{
 	if (v == NULL) {
 		fprintf(stderr, "Null pointer !\n");
 		return -1;
 	} else
-		memset((void *)v, 0, sizeof(struct firmware_versions_long));
-
-	while (sz >= sizeof(fip)) {
-
-		/* Scan for the FIP magic */
-		while (sz >= sizeof(fip)) {
-			memcpy(&magic, databytes, sizeof(magic));
-			if (magic == FIP_PATTERN) {
-				magic_found = 1;
-				break;
-			}
-			databytes += sizeof(magic);
-			sz -= sizeof(magic);
-		}
+		memset((void *)v, 0, sizeof(struct firmware_versions));
 
-		if (!magic_found) {
-			fprintf(stderr, "Couldn't find FIP magic in image!\n");
-			return -1;
-		}
-		if (sz < sizeof(fip)) {
-			break;
-		}
+	return scan_fip(data, sz, sizeof(struct FIP_header), apply_fip, v);
+}
 
-		memcpy(&fip, databytes, sizeof(fip));
-
-		/* not available in ifwi file */
-		v->scubootstrap.minor = 0;
-		v->scubootstrap.major = 0;
-
-		/* don't update if null */
-		if (fip.scuc_rev.minor != 0)
-			v->scu.minor = fip.scuc_rev.minor;
-		if (fip.scuc_rev.major != 0)
-			v->scu.major = fip.scuc_rev.major;
-		if (fip.ia32_rev.minor != 0)
-			v->ia32.minor = fip.ia32_rev.minor;
-		if (fip.ia32_rev.major != 0)
-			v->ia32.major = fip.ia32_rev.major;
-		if (fip.oem_rev.minor != 0)
-			v->valhooks.minor = fip.oem_rev.minor;
-		if (fip.oem_rev.major != 0)
-			v->valhooks.major = fip.oem_rev.major;
-		if (fip.ifwi_rev.minor != 0)
-			v->ifwi.minor = fip.ifwi_rev.minor;
-		if (fip.ifwi_rev.major != 0)
-			v->ifwi.major = fip.ifwi_rev.major;
-		if (fip.ch00_rev.minor != 0)
-			v->chaabi.minor = fip.ch00_rev.minor;
-		if (fip.ch00_rev.major != 0)
-			v->chaabi.major = fip.ch00_rev.major;
-		if (fip.mia_rev.minor != 0)
-			v->mia.minor = fip.mia_rev.minor;
-		if (fip.mia_rev.major != 0)
-			v->mia.major = fip.mia_rev.major;
-
-		databytes += sizeof(magic);
-		sz -= sizeof(magic);
-	}
+int get_image_fw_rev_long(void *data, unsigned sz, struct firmware_versions_long *v)
+{
+	if (v == NULL) {
+		fprintf(stderr, "Null pointer !\n");
+		return -1;
+	} else
+		memset((void *)v, 0, sizeof(struct firmware_versions_long));
 
-	return 0;
+	return scan_fip(data, sz, sizeof(struct FIP_header_long), apply_fip_long, v);
 }
 
 int crack_update_fw(const char *fw_file, struct fw_version *ifwi_version)
@@ -226,12 +226,97 @@ bad:
 }
 
 
+// Resolves an automatic begin and a relative size against the drive, and
+// aligns the partition to the erase unit of the drive when asked to. The
+// sectors given up for alignment are reported since they are never used.
+static int PlacePartition(struct drive *drive, GptEntry *entry,
+                          uint32_t index, CgptAddParams *params) {
+  GptHeader *h = (GptHeader *)drive->gpt.primary_header;
+  uint64_t usable = h->last_usable_lba - h->first_usable_lba + 1;
+  uint64_t align = params->align ? GetEraseAlignment(drive) : 1;
+  uint32_t max_part = GetNumberOfEntries(&drive->gpt);
+  uint64_t begin, natural_begin, size = 0, natural_size = 0;
+  GptEntry *e;
+  uint32_t i;
+
+  if (!params->set_begin && !params->begin_auto && !params->set_size)
+    return CGPT_OK;
+
+  begin = params->set_begin ? params->begin : entry->starting_lba;
+  if (params->begin_auto) {
+    begin = h->first_usable_lba;
+    for (i = 0; i < max_part; i++) {
+      e = GetEntry(&drive->gpt, PRIMARY, i);
+      if (i != index && !IsZero(&e->type) && e->ending_lba >= begin)
+        begin = e->ending_lba + 1;
+    }
+  }
+  natural_begin = begin;
+  if (params->set_begin || params->begin_auto)
+    begin = (begin + align - 1) / align * align;
+
+  if (params->set_size) {
+    switch (params->size_unit) {
+    case CGPT_SIZE_BYTES:
+      size = (params->size + drive->gpt.sector_bytes - 1) /
+          drive->gpt.sector_bytes;
+      break;
+    case CGPT_SIZE_PERCENT:
+      size = usable * params->size / 100;
+      break;
+    case CGPT_SIZE_FROM_END:
+      if (begin + params->size >= drive->gpt.drive_sectors) {
+        Error("no room left before $lba_end-%llu\n",
+              (unsigned long long)params->size);
+        return CGPT_FAILED;
+      }
+      size = drive->gpt.drive_sectors - begin - params->size;
+      break;
+    default:
+      size = params->size;
+      break;
+    }
+
+    // Sizes relative to the drive shrink to stay within it, absolute
+    // ones grow so that the next partition starts aligned.
+    natural_size = size;
+    if (params->size_unit == CGPT_SIZE_PERCENT ||
+        params->size_unit == CGPT_SIZE_FROM_END)
+      size = size / align * align;
+    else
+      size = (size + align - 1) / align * align;
+    if (!size) {
+      Error("partition size rounds down to 0\n");
+      return CGPT_FAILED;
+    }
+  }
+
+  if (params->align)
+    printf("Partition %u: begin %llu size %llu, %llu sectors lost to "
+           "%llu sector alignment\n", index + 1,
+           (unsigned long long)begin, (unsigned long long)size,
+           (unsigned long long)(begin - natural_begin +
+                                (natural_size > size ? natural_size - size : 0)),
+           (unsigned long long)align);
+
+  if (params->set_begin || params->begin_auto) {
+    params->begin = begin;
+    params->set_begin = 1;
+  }
+  if (params->set_size) {
+    params->size = size;
+    params->size_unit = CGPT_SIZE_SECTORS;
+  }
+  return CGPT_OK;
+}
+
 int cgpt_add(CgptAddParams *params) {
   struct drive drive;
 
   int gpt_retval;
   GptEntry *entry, backup;
-  uint32_t index;
+  GptEntryConflicts conflicts;
+  uint32_t index, i;
   int rv;
 
   if (params == NULL)
@@ -277,6 +362,9 @@ int cgpt_add(CgptAddParams *params) {
   }
   memcpy(&backup, entry, sizeof(backup));
 
+  if (CGPT_OK != PlacePartition(&drive, entry, index, params))
+    goto bad;
+
   // New partitions must specify type, begin, and size.
   if (IsZero(&entry->type)) {
     if (!params->set_begin || !params->set_size || !params->set_type) {
@@ -320,13 +408,19 @@ int cgpt_add(CgptAddParams *params) {
                          GPT_MODIFIED_HEADER2 | GPT_MODIFIED_ENTRIES2);
   UpdateCrc(&drive.gpt);
 
-  rv = CheckEntries((GptEntry*)drive.gpt.primary_entries,
-                    (GptHeader*)drive.gpt.primary_header);
+  rv = CheckEntriesConflicts((GptEntry*)drive.gpt.primary_entries,
+                             (GptHeader*)drive.gpt.primary_header,
+                             &conflicts);
 
   if (0 != rv) {
     // If the modified entry is illegal, recover it and return error.
     memcpy(entry, &backup, sizeof(*entry));
-    Error("%s\n", GptErrorText(rv));
+    for (i = 0; i < conflicts.count && i < MAX_ENTRY_CONFLICTS; i++)
+      Error("partition %u: %s (partition %u)\n", conflicts.list[i].index + 1,
+            GptErrorText(conflicts.list[i].error),
+            conflicts.list[i].other + 1);
+    if (!conflicts.count)
+      Error("%s\n", GptErrorText(rv));
     Error(DumpCgptAddParams(params));
     goto bad;
   }
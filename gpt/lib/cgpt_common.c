@@ -19,16 +19,33 @@
 #include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <linux/fs.h>
 
 #include "cgptlib_internal.h"
+#include "cgpt_params.h"
 #include "crc32.h"
 
 const char* progname = "cgpt";
 const char* command = "cgpt";
 
+// While a batch is open, DriveOpen() on the batch drive hands out a view of
+// the in-memory GPT instead of re-reading the disk, and DriveClose() folds
+// the changes back instead of writing them. CgptBatchCommit() validates the
+// result and writes everything out once.
+static struct {
+  int active;
+  int pmbr_modified;
+  char *path;
+  struct drive drive;
+} batch;
+
+static int InBatch(const struct drive *drive) {
+  return batch.active && drive->fd == batch.drive.fd;
+}
+
 
 void uuid_generate(uint8_t* buffer) {
   int fd;
@@ -118,6 +135,11 @@ error_free:
 
 
 int ReadPMBR(struct drive *drive) {
+  if (InBatch(drive)) {
+    memcpy(&drive->pmbr, &batch.drive.pmbr, sizeof(struct pmbr));
+    return CGPT_OK;
+  }
+
   if (-1 == lseek64(drive->fd, 0, SEEK_SET))
     return CGPT_FAILED;
 
@@ -129,6 +151,12 @@ int ReadPMBR(struct drive *drive) {
 }
 
 int WritePMBR(struct drive *drive) {
+  if (InBatch(drive)) {
+    memcpy(&batch.drive.pmbr, &drive->pmbr, sizeof(struct pmbr));
+    batch.pmbr_modified = 1;
+    return CGPT_OK;
+  }
+
   if (-1 == lseek64(drive->fd, 0, SEEK_SET))
     return CGPT_FAILED;
 
@@ -181,6 +209,11 @@ int DriveOpen(const char *drive_path, struct drive *drive, int mode) {
   require(drive_path);
   require(drive);
 
+  if (batch.active && !strcmp(drive_path, batch.path)) {
+    memcpy(drive, &batch.drive, sizeof(struct drive));
+    return CGPT_OK;
+  }
+
   // Clear struct for proper error handling.
   memset(drive, 0, sizeof(struct drive));
 
@@ -251,6 +284,12 @@ error_close:
 int DriveClose(struct drive *drive, int update_as_needed) {
   int errors = 0;
 
+  if (InBatch(drive)) {
+    if (update_as_needed)
+      memcpy(&batch.drive.gpt, &drive->gpt, sizeof(GptData));
+    return CGPT_OK;
+  }
+
   if (update_as_needed) {
     if (drive->gpt.modified & GPT_MODIFIED_HEADER1) {
       if (CGPT_OK != Save(drive->fd, drive->gpt.primary_header,
@@ -307,6 +346,138 @@ int DriveClose(struct drive *drive, int update_as_needed) {
 }
 
 
+// Opens 'drive_path' and keeps its GPT in memory until CgptBatchCommit() or
+// CgptBatchAbort(). mode should be O_RDONLY (dry run) or O_RDWR.
+int CgptBatchBegin(const char *drive_path, int mode) {
+  require(drive_path);
+
+  if (batch.active) {
+    Error("a batch is already open on %s\n", batch.path);
+    return CGPT_FAILED;
+  }
+
+  if (CGPT_OK != DriveOpen(drive_path, &batch.drive, mode))
+    return CGPT_FAILED;
+
+  if (CGPT_OK != ReadPMBR(&batch.drive)) {
+    Error("Unable to read PMBR from %s\n", drive_path);
+    (void) DriveClose(&batch.drive, 0);
+    return CGPT_FAILED;
+  }
+
+  batch.path = strdup(drive_path);
+  require(batch.path);
+  batch.pmbr_modified = 0;
+  batch.active = 1;
+  return CGPT_OK;
+}
+
+// Returns the path of the drive the open batch works on, NULL if none.
+const char *CgptBatchPath(void) {
+  return batch.active ? batch.path : NULL;
+}
+
+static void BatchRelease(void) {
+  batch.active = 0;
+  (void) DriveClose(&batch.drive, 0);
+  free(batch.path);
+  batch.path = NULL;
+}
+
+// Drops every change made since CgptBatchBegin().
+void CgptBatchAbort(void) {
+  if (batch.active)
+    BatchRelease();
+}
+
+// Checks the in-memory GPT once and writes it out. The primary copy is
+// written and synced before the secondary one is touched, so an interrupted
+// commit always leaves one consistent copy that 'cgpt repair' can restore
+// the other from.
+int CgptBatchCommit(void) {
+  struct drive *drive = &batch.drive;
+  uint8_t modified = drive->gpt.modified;
+  int gpt_retval;
+  int errors = 0;
+
+  if (!batch.active)
+    return CGPT_OK;
+
+  if (!modified && !batch.pmbr_modified)
+    goto done;
+
+  if (GPT_SUCCESS != (gpt_retval = GptSanityCheck(&drive->gpt))) {
+    Error("GptSanityCheck() returned %d: %s\n",
+          gpt_retval, GptError(gpt_retval));
+    errors++;
+    goto done;
+  }
+  if (drive->gpt.valid_headers != MASK_BOTH ||
+      drive->gpt.valid_entries != MASK_BOTH) {
+    Error("refusing to commit an inconsistent GPT to %s\n", batch.path);
+    errors++;
+    goto done;
+  }
+
+  if (modified & GPT_MODIFIED_ENTRIES1 &&
+      CGPT_OK != Save(drive->fd, drive->gpt.primary_entries,
+                      GPT_PMBR_SECTOR + GPT_HEADER_SECTOR,
+                      drive->gpt.sector_bytes, GPT_ENTRIES_SECTORS)) {
+    Error("Cannot write primary entries: %s\n", strerror(errno));
+    errors++;
+    goto done;
+  }
+  if (modified & GPT_MODIFIED_HEADER1 &&
+      CGPT_OK != Save(drive->fd, drive->gpt.primary_header,
+                      GPT_PMBR_SECTOR,
+                      drive->gpt.sector_bytes, GPT_HEADER_SECTOR)) {
+    Error("Cannot write primary header: %s\n", strerror(errno));
+    errors++;
+    goto done;
+  }
+  if (fsync(drive->fd)) {
+    Error("Cannot sync primary GPT: %s\n", strerror(errno));
+    errors++;
+    goto done;
+  }
+
+  if (modified & GPT_MODIFIED_ENTRIES2 &&
+      CGPT_OK != Save(drive->fd, drive->gpt.secondary_entries,
+                      drive->gpt.drive_sectors - GPT_HEADER_SECTOR
+                      - GPT_ENTRIES_SECTORS,
+                      drive->gpt.sector_bytes, GPT_ENTRIES_SECTORS)) {
+    Error("Cannot write secondary entries: %s\n", strerror(errno));
+    errors++;
+    goto done;
+  }
+  if (modified & GPT_MODIFIED_HEADER2 &&
+      CGPT_OK != Save(drive->fd, drive->gpt.secondary_header,
+                      drive->gpt.drive_sectors - GPT_PMBR_SECTOR,
+                      drive->gpt.sector_bytes, GPT_HEADER_SECTOR)) {
+    Error("Cannot write secondary header: %s\n", strerror(errno));
+    errors++;
+    goto done;
+  }
+
+  if (batch.pmbr_modified) {
+    batch.active = 0;
+    if (CGPT_OK != WritePMBR(drive)) {
+      Error("Cannot write PMBR: %s\n", strerror(errno));
+      errors++;
+      goto done;
+    }
+  }
+
+  if (fsync(drive->fd)) {
+    Error("Cannot sync GPT: %s\n", strerror(errno));
+    errors++;
+  }
+
+done:
+  BatchRelease();
+  return errors ? CGPT_FAILED : CGPT_OK;
+}
+
 /* GUID conversion functions. Accepted format:
  *
  *   "C12A7328-F81F-11D2-BA4B-00A0C93EC93B"
@@ -625,6 +796,84 @@ int SupportedType(const char *name, Guid *type) {
   return CGPT_FAILED;
 }
 
+int ParseSize(const char *str, uint64_t *size, int *unit) {
+  unsigned long long lba_sub;
+  char *e;
+
+  if (1 == sscanf(str, "$calc($lba_end-%llu)", &lba_sub)) {
+    *size = lba_sub;
+    *unit = CGPT_SIZE_FROM_END;
+    return CGPT_OK;
+  }
+
+  if (!*str)
+    return CGPT_FAILED;
+  errno = 0;
+  *size = strtoull(str, &e, 0);
+  if (errno)
+    return CGPT_FAILED;
+
+  *unit = CGPT_SIZE_SECTORS;
+  switch (*e) {
+  case '\0':
+    return CGPT_OK;
+  case '%':
+    *unit = CGPT_SIZE_PERCENT;
+    if (*size > 100)
+      return CGPT_FAILED;
+    break;
+  case 'G':
+    *size <<= 10;
+    // fall through
+  case 'M':
+    *size <<= 10;
+    // fall through
+  case 'K':
+    *size <<= 10;
+    *unit = CGPT_SIZE_BYTES;
+    break;
+  default:
+    return CGPT_FAILED;
+  }
+
+  return e[1] ? CGPT_FAILED : CGPT_OK;
+}
+
+static uint64_t ReadSysfsBytes(unsigned int major, unsigned int minor,
+                               const char *attr) {
+  char path[128];
+  unsigned long long value = 0;
+  FILE *fp;
+
+  snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/device/%s",
+           major, minor, attr);
+  fp = fopen(path, "r");
+  if (!fp)
+    return 0;
+  if (1 != fscanf(fp, "%llu", &value))
+    value = 0;
+  fclose(fp);
+  return value;
+}
+
+uint64_t GetEraseAlignment(const struct drive *drive) {
+  const uint64_t fallback = 1024 * 1024;
+  uint64_t erase = 0, preferred = 0, bytes;
+  struct stat st;
+
+  if (0 == fstat(drive->fd, &st) && S_ISBLK(st.st_mode)) {
+    erase = ReadSysfsBytes(major(st.st_rdev), minor(st.st_rdev),
+                           "erase_size");
+    preferred = ReadSysfsBytes(major(st.st_rdev), minor(st.st_rdev),
+                               "preferred_erase_size");
+  }
+
+  bytes = erase > preferred ? erase : preferred;
+  if (!bytes || bytes % drive->gpt.sector_bytes)
+    bytes = fallback;
+  return bytes / drive->gpt.sector_bytes;
+}
+
 void PrintTypes(void) {
   unsigned int i;
   printf("The partition type may also be given as one of these aliases:\n\n");
@@ -116,11 +116,80 @@ int IsKernelEntry(const GptEntry* e) {
 }
 
 
-int CheckEntries(GptEntry* entries, GptHeader* h) {
+/* Sorts the entry indices by starting LBA (heapsort: no allocation and
+ * O(n log n) whatever the order of the table). */
+static void SortByStartingLba(const GptEntry* entries, uint16_t* idx,
+                              uint32_t count) {
+  uint32_t start, end, root, child;
+  uint16_t tmp;
+
+  if (count < 2)
+    return;
+  for (start = count / 2, end = count; end > 1;) {
+    if (start > 0) {
+      start--;
+    } else {
+      end--;
+      tmp = idx[0];
+      idx[0] = idx[end];
+      idx[end] = tmp;
+    }
+    for (root = start; (child = 2 * root + 1) < end; root = child) {
+      if (child + 1 < end && entries[idx[child + 1]].starting_lba >
+          entries[idx[child]].starting_lba)
+        child++;
+      if (entries[idx[root]].starting_lba >= entries[idx[child]].starting_lba)
+        break;
+      tmp = idx[root];
+      idx[root] = idx[child];
+      idx[child] = tmp;
+    }
+  }
+}
 
-  GptEntry* entry;
+/* Open addressing table of unique GUIDs, at most half full. */
+#define GUID_HASH_SLOTS (2 * MAX_NUMBER_OF_ENTRIES)
+
+static uint32_t GuidHash(const Guid* guid) {
+  uint32_t hash = 2166136261U;
+  int i;
+
+  for (i = 0; i < GUID_SIZE; i++)
+    hash = (hash ^ guid->u.raw[i]) * 16777619U;
+  return hash;
+}
+
+/* Records a conflict. Returns non-zero when the caller should stop looking
+ * for more, that is when it does not collect them. */
+static int AddConflict(GptEntryConflicts* conflicts, int error,
+                       uint32_t index, uint32_t other) {
+  if (!conflicts)
+    return 1;
+  if (conflicts->count < MAX_ENTRY_CONFLICTS) {
+    conflicts->list[conflicts->count].error = error;
+    conflicts->list[conflicts->count].index = index;
+    conflicts->list[conflicts->count].other = other;
+  }
+  conflicts->count++;
+  return 0;
+}
+
+int CheckEntriesConflicts(GptEntry* entries, GptHeader* h,
+                          GptEntryConflicts* conflicts) {
+  uint16_t used[MAX_NUMBER_OF_ENTRIES];
+  uint16_t guids[GUID_HASH_SLOTS];
+  uint32_t num_used = 0;
   uint32_t crc32;
-  uint32_t i;
+  uint32_t i, slot;
+  int rv = 0;
+  GptEntry* entry;
+  GptEntry* last;
+
+  if (conflicts)
+    conflicts->count = 0;
+
+  if (h->number_of_entries > MAX_NUMBER_OF_ENTRIES)
+    return GPT_ERROR_INVALID_ENTRIES;
 
   /* Check CRC before examining entries. */
   crc32 = Crc32((const uint8_t *)entries,
@@ -128,40 +197,65 @@ int CheckEntries(GptEntry* entries, GptHeader* h) {
   if (crc32 != h->entries_crc32)
     return GPT_ERROR_CRC_CORRUPTED;
 
-  /* Check all entries. */
+  /* Entries must be in valid region. */
   for (i = 0, entry = entries; i < h->number_of_entries; i++, entry++) {
-    GptEntry* e2;
-    uint32_t i2;
-
     if (IsUnusedEntry(entry))
       continue;
+    used[num_used++] = i;
 
-    /* Entry must be in valid region. */
     if ((entry->starting_lba < h->first_usable_lba) ||
         (entry->ending_lba > h->last_usable_lba) ||
-        (entry->ending_lba < entry->starting_lba))
-      return GPT_ERROR_OUT_OF_REGION;
-
-    /* Entry must not overlap other entries. */
-    for (i2 = 0, e2 = entries; i2 < h->number_of_entries; i2++, e2++) {
-      if (i2 == i || IsUnusedEntry(e2))
-        continue;
-
-      if ((entry->starting_lba >= e2->starting_lba) &&
-          (entry->starting_lba <= e2->ending_lba))
-        return GPT_ERROR_START_LBA_OVERLAP;
-      if ((entry->ending_lba >= e2->starting_lba) &&
-          (entry->ending_lba <= e2->ending_lba))
-        return GPT_ERROR_END_LBA_OVERLAP;
-
-      /* UniqueGuid field must be unique. */
-      if (0 == Memcmp(&entry->unique, &e2->unique, sizeof(Guid)))
-        return GPT_ERROR_DUP_GUID;
+        (entry->ending_lba < entry->starting_lba)) {
+      if (!rv)
+        rv = GPT_ERROR_OUT_OF_REGION;
+      if (AddConflict(conflicts, GPT_ERROR_OUT_OF_REGION, i, i))
+        return rv;
     }
   }
 
-  /* Success */
-  return 0;
+  /* Entries must not overlap: once sorted by starting LBA, an entry
+   * overlaps an earlier one iff it starts before the furthest end seen
+   * so far. */
+  SortByStartingLba(entries, used, num_used);
+  for (i = 1, last = num_used ? &entries[used[0]] : NULL; i < num_used; i++) {
+    entry = &entries[used[i]];
+    if (entry->starting_lba <= last->ending_lba) {
+      if (!rv)
+        rv = GPT_ERROR_START_LBA_OVERLAP;
+      if (AddConflict(conflicts, GPT_ERROR_START_LBA_OVERLAP, used[i],
+                      (uint32_t)(last - entries)))
+        return rv;
+    }
+    if (entry->ending_lba > last->ending_lba)
+      last = entry;
+  }
+
+  /* UniqueGuid field must be unique. */
+  Memset(guids, 0, sizeof(guids));
+  for (i = 0, entry = entries; i < h->number_of_entries; i++, entry++) {
+    if (IsUnusedEntry(entry))
+      continue;
+    for (slot = GuidHash(&entry->unique) % GUID_HASH_SLOTS;
+         guids[slot]; slot = (slot + 1) % GUID_HASH_SLOTS) {
+      if (0 == Memcmp(&entry->unique, &entries[guids[slot] - 1].unique,
+                      sizeof(Guid)))
+        break;
+    }
+    if (guids[slot]) {
+      if (!rv)
+        rv = GPT_ERROR_DUP_GUID;
+      if (AddConflict(conflicts, GPT_ERROR_DUP_GUID, i, guids[slot] - 1))
+        return rv;
+    } else {
+      guids[slot] = i + 1;
+    }
+  }
+
+  return rv;
+}
+
+int CheckEntries(GptEntry* entries, GptHeader* h) {
+  return CheckEntriesConflicts(entries, h, NULL);
 }
 
 
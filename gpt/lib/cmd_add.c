@@ -17,8 +17,10 @@ static void Usage(void)
          "Add, edit, or remove a partition entry.\n\n"
          "Options:\n"
          "  -i NUM       Specify partition (default is next available)\n"
-         "  -b NUM       Beginning sector\n"
-         "  -s NUM       Size in sectors\n"
+         "  -b NUM       Beginning sector, or \"auto\" to follow the last partition\n"
+         "  -s NUM       Size in sectors, in bytes with a K, M or G suffix,\n"
+         "               in percent of the drive with %%, or $calc($lba_end-NUM)\n"
+         "  -a           Align begin and size to the erase unit of the drive\n"
          "  -t GUID      Partition Type GUID\n"
          "  -u GUID      Partition Unique ID\n"
          "  -l LABEL     Label\n"
@@ -33,37 +35,6 @@ static void Usage(void)
   PrintTypes();
 }
 
-static unsigned long long _lba_count(const char *blk_device)
-{
-    unsigned long long numblocks = 0;
-    int fd;
-
-    fd = open(blk_device, O_RDONLY);
-    if (fd != -1) {
-      ioctl(fd, BLKGETSIZE64, &numblocks);
-      close(fd);
-    }
-    return numblocks/512;
-}
-
-static int parse_lba_end(const char *line, unsigned long long *lba_end)
-{
-        unsigned long long lba_sub;
-
-	*lba_end = 0;
-
-	line = strstr(line, "$calc(");
-	if (!line)
-	        return -1;
-
-	if (1 != sscanf(line,"$calc($lba_end-%llu)", &lba_sub))
-                return -1;
-
-	*lba_end = lba_sub;
-
-	return 0;
-}
-
 int cmd_add(int argc, char *argv[]) {
 
   CgptAddParams params;
@@ -72,10 +43,9 @@ int cmd_add(int argc, char *argv[]) {
   int c;
   int errorcnt = 0;
   char *e = 0;
-  unsigned long long lba_end;
 
   opterr = 0;                     // quiet, you
-  while ((c=getopt(argc, argv, ":hi:b:s:t:u:l:S:T:P:A:")) != -1)
+  while ((c=getopt(argc, argv, ":hai:b:s:t:u:l:S:T:P:A:")) != -1)
   {
     switch (c)
     {
@@ -87,7 +57,14 @@ int cmd_add(int argc, char *argv[]) {
         errorcnt++;
       }
       break;
+    case 'a':
+      params.align = 1;
+      break;
     case 'b':
+      if (!strcmp(optarg, "auto")) {
+        params.begin_auto = 1;
+        break;
+      }
       params.set_begin = 1;
       params.begin = strtoull(optarg, &e, 0);
       if (!*optarg || (e && *e))
@@ -98,12 +75,7 @@ int cmd_add(int argc, char *argv[]) {
       break;
     case 's':
       params.set_size = 1;
-      if (!parse_lba_end(optarg, &lba_end)) {
-        params.size = ( _lba_count(argv[argc-1] ) - params.begin) - lba_end ;
-      } else
-         params.size = strtoull(optarg, &e, 0);
-
-      if (!*optarg || (e && *e))
+      if (CGPT_OK != ParseSize(optarg, &params.size, &params.size_unit))
       {
         Error("invalid argument to -%c: \"%s\"\n", c, optarg);
         errorcnt++;
@@ -67,6 +67,15 @@ int DriveOpen(const char *drive_path, struct drive *drive, int mode);
 int DriveClose(struct drive *drive, int update_as_needed);
 int CheckValid(const struct drive *drive);
 
+/* Batch mode: between CgptBatchBegin() and CgptBatchCommit()/CgptBatchAbort()
+ * every DriveOpen()/DriveClose() on the same path works on one in-memory copy
+ * of the GPT, which is checked and written to disk only once on commit.
+ */
+int CgptBatchBegin(const char *drive_path, int mode);
+int CgptBatchCommit(void);
+void CgptBatchAbort(void);
+const char *CgptBatchPath(void);
+
 /* GUID conversion functions. Accepted format:
  *
  *   "C12A7328-F81F-11D2-BA4B-00A0C93EC93B"
@@ -111,6 +120,17 @@ int UTF16ToUTF8(const uint16_t *utf16, unsigned int maxinput,
  */
 int UTF8ToUTF16(const uint8_t *utf8, uint16_t *utf16, unsigned int maxoutput);
 
+/* Parses a partition size: a number of sectors, a number of bytes with a
+ * K, M or G suffix, a percentage of the drive, or "$calc($lba_end-N)".
+ * 'unit' is set to one of the CGPT_SIZE_* values of cgpt_params.h.
+ */
+int ParseSize(const char *str, uint64_t *size, int *unit);
+
+/* Returns the erase unit of the drive in sectors: the larger of the eMMC
+ * erase group and preferred erase size, or 1 MiB when sysfs has neither.
+ */
+uint64_t GetEraseAlignment(const struct drive *drive);
+
 /* Helper functions for supported GPT types. */
 int ResolveType(const Guid *type, char *buf);
 int SupportedType(const char *name, Guid *type);
@@ -16,11 +16,22 @@ typedef struct CgptCreateParams {
   int zap;
 } CgptCreateParams;
 
+// Units of CgptAddParams.size
+enum {
+  CGPT_SIZE_SECTORS = 0,
+  CGPT_SIZE_BYTES,
+  CGPT_SIZE_PERCENT,    // of the usable space of the drive
+  CGPT_SIZE_FROM_END,   // sectors left between the partition and the end
+};
+
 typedef struct CgptAddParams {
   char *drive_name;
   uint32_t partition;
   uint64_t begin;
   uint64_t size;
+  int size_unit;
+  int begin_auto;       // right after the last partition
+  int align;            // to the erase unit of the drive
   Guid type_guid;
   Guid unique_guid;
   char *label;
@@ -87,9 +87,31 @@ uint32_t HeaderCrc(GptHeader* h);
 
 /* Check entries.
  *
- * Returns 0 if entries are valid, 1 if invalid. */
+ * Returns 0 if entries are valid, the GPT_ERROR_* code of the first
+ * problem found otherwise. */
 int CheckEntries(GptEntry* entries, GptHeader* h);
 
+/* A conflict found by CheckEntriesConflicts(): entry 'index' is out of the
+ * usable region (then 'other' is 'index'), starts inside entry 'other', or
+ * has the same unique GUID as entry 'other'. */
+typedef struct {
+  int error;  /* GPT_ERROR_* */
+  uint32_t index;
+  uint32_t other;
+} GptEntryConflict;
+
+#define MAX_ENTRY_CONFLICTS 16
+
+typedef struct {
+  uint32_t count;  /* may exceed MAX_ENTRY_CONFLICTS */
+  GptEntryConflict list[MAX_ENTRY_CONFLICTS];
+} GptEntryConflicts;
+
+/* Same as CheckEntries(), but carries on after the first problem and
+ * records every conflict in 'conflicts'. */
+int CheckEntriesConflicts(GptEntry* entries, GptHeader* h,
+                          GptEntryConflicts* conflicts);
+
 /* Check GptData, headers, entries.
  *
  * If successful, sets gpt->valid_headers and gpt->valid_entries and returns
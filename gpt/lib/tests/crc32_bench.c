@@ -0,0 +1,59 @@
+/* Throughput of the CRC32 implementations on the sizes GPT code hashes:
+ * a header, a full partition entry array, and a large buffer. Built on
+ * the host with "make bench" from gpt/.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/* The implementations and the tables are static */
+#include "../crc32.c"
+
+#define BENCH_BYTES (256 << 20)
+
+static uint8_t buffer[1 << 20];
+
+static uint64_t NowNs(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void Bench(const char *name,
+                  uint32_t (*impl)(uint32_t, const uint8_t *, uint32_t),
+                  uint32_t len) {
+  uint64_t rounds = BENCH_BYTES / len;
+  uint64_t i, start, ns;
+  volatile uint32_t sink = 0;
+
+  start = NowNs();
+  for (i = 0; i < rounds; i++)
+    sink ^= impl(~0U, buffer, len);
+  ns = NowNs() - start;
+
+  printf("%-8s %8u bytes: %8.1f MB/s\n", name, len,
+         (double)rounds * len * 1000 / (ns ? ns : 1));
+}
+
+int main(void) {
+  static const uint32_t sizes[] = { 92, 16384, sizeof(buffer) };
+  uint32_t i;
+
+  for (i = 0; i < sizeof(buffer); i++)
+    buffer[i] = i * 2654435761U >> 24;
+
+  /* Builds the tables and picks the implementation */
+  Crc32(buffer, 0);
+
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    Bench("bytes", Crc32Bytes, sizes[i]);
+    Bench("slice8", Crc32Slice8, sizes[i]);
+#ifdef CRC32_PCLMUL
+    if (crc32_impl == Crc32PclmulOrSlice8)
+      Bench("pclmul", Crc32PclmulOrSlice8, sizes[i]);
+#endif
+  }
+  return 0;
+}
@@ -0,0 +1,103 @@
+/* Known-answer test of Crc32() against the byte at a time crc32_tab
+ * loop, for every implementation the CPU can run. Built on the host with
+ * "make test" from gpt/.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The implementations and the tables are static */
+#include "../crc32.c"
+
+#define TEST_SIZE (1 << 20)
+#define TEST_THREADS 8
+
+static uint8_t buffer[TEST_SIZE + 16];
+static int failures;
+
+static uint32_t Reference(const uint8_t *byte, uint32_t len) {
+  return Crc32Bytes(~0U, byte, len) ^ ~0U;
+}
+
+static void Check(const char *name,
+                  uint32_t (*impl)(uint32_t, const uint8_t *, uint32_t),
+                  const uint8_t *byte, uint32_t len) {
+  uint32_t got = impl(~0U, byte, len) ^ ~0U;
+  uint32_t want = Reference(byte, len);
+
+  if (got != want) {
+    fprintf(stderr, "%s: %u bytes at +%u: %08x, expected %08x\n", name, len,
+            (unsigned)((uintptr_t)byte & 15), got, want);
+    failures++;
+  }
+}
+
+static uint32_t Public(uint32_t value, const uint8_t *byte, uint32_t len) {
+  return Crc32(byte, len) ^ ~0U;
+}
+
+static void CheckAll(const char *name,
+                     uint32_t (*impl)(uint32_t, const uint8_t *, uint32_t)) {
+  uint32_t len, align;
+
+  for (len = 0; len <= 1024; len++)
+    for (align = 0; align < 16; align++)
+      Check(name, impl, buffer + align, len);
+  for (len = 1024; len <= TEST_SIZE; len = len * 3 / 2 + 1)
+    Check(name, impl, buffer + len % 16, len);
+  Check(name, impl, buffer, TEST_SIZE);
+}
+
+/* Every thread makes its first call at the same time, while the tables
+ * are being built */
+static pthread_barrier_t start;
+
+static void *FirstCall(void *arg) {
+  uint32_t *crc = arg;
+
+  pthread_barrier_wait(&start);
+  *crc = Crc32(buffer, 16384);
+  return NULL;
+}
+
+int main(void) {
+  pthread_t threads[TEST_THREADS];
+  uint32_t crcs[TEST_THREADS];
+  uint32_t i;
+
+  srand(1);
+  for (i = 0; i < sizeof(buffer); i++)
+    buffer[i] = rand();
+
+  pthread_barrier_init(&start, NULL, TEST_THREADS);
+  for (i = 0; i < TEST_THREADS; i++)
+    pthread_create(&threads[i], NULL, FirstCall, &crcs[i]);
+  for (i = 0; i < TEST_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+    if (crcs[i] != Reference(buffer, 16384)) {
+      fprintf(stderr, "first call from thread %u: %08x, expected %08x\n", i,
+              crcs[i], Reference(buffer, 16384));
+      failures++;
+    }
+  }
+
+  if (Crc32("123456789", 9) != 0xcbf43926U) {
+    fprintf(stderr, "Crc32(\"123456789\"): %08x, expected cbf43926\n",
+            Crc32("123456789", 9));
+    failures++;
+  }
+
+  CheckAll("Crc32", Public);
+  CheckAll("slice8", Crc32Slice8);
+#ifdef CRC32_PCLMUL
+  if (crc32_impl == Crc32PclmulOrSlice8)
+    CheckAll("pclmul", Crc32PclmulOrSlice8);
+  else
+    printf("no PCLMULQDQ, pclmul not tested\n");
+#endif
+
+  printf("%s\n", failures ? "FAIL" : "PASS");
+  return failures ? 1 : 0;
+}
@@ -17,13 +17,25 @@
 #include "oem_partition.h"
 
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <cgpt.h>
+#include <cgpt_params.h>
 #include <cutils/properties.h>
 #include <roots.h>
 
 #include "util.h"
+#include "flash.h"
+#include "flash_ops.h"
+#include "update_osip.h"
+#include "partition_plan.h"
+#include "perf.h"
+#include "erase_queue.h"
 
 
 
@@ -41,141 +53,429 @@ static struct ufdisk ufdisk = {
 	.create_partition = fake_create_partition
 };
 
-char **str_to_array(char *str, int *argc)
+/* Partition device nodes come and go with the re-read table */
+static int cmd_reload_and_invalidate(int argc, char *argv[])
 {
-	char *str1, *token;
-	char *saveptr1;
-	int j;
-	int num_tokens;
-	char **tokens;
+	int ret = cmd_reload(argc, argv);
 
-	tokens = malloc(sizeof(char *) * K_MAX_ARGS);
-
-	if (tokens == NULL)
-		return NULL;
+	invalidate_device_cache();
+	return ret;
+}
 
-	num_tokens = 0;
+static int (*indirected_cmd_reload) (int argc, char *argv[]) = cmd_reload_and_invalidate;
 
-	for (j = 1, str1 = str;; j++, str1 = NULL) {
-		token = strtok_r(str1, " ", &saveptr1);
+static int cmd_noop(int argc, char **argv)
+{
+	return 0;
+}
 
-		if (token == NULL)
-			break;
+void oem_partition_disable_cmd_reload()
+{
+	indirected_cmd_reload = cmd_noop;
+}
 
-		tokens[num_tokens] = (char *)malloc(sizeof(char) * K_MAX_ARG_LEN + 1);
+static int cmd_reload_indirect(int argc, char *argv[])
+{
+	return indirected_cmd_reload(argc, argv);
+}
 
-		if (tokens[num_tokens] == NULL)
-			break;
+/* Indexed by enum plan_command */
+static int (*const gpt_commands[PLAN_COMMANDS]) (int argc, char *argv[]) = {
+	[PLAN_CREATE] = cmd_create,
+	[PLAN_ADD] = cmd_add,
+	[PLAN_DUMP] = cmd_show,
+	[PLAN_REPAIR] = cmd_repair,
+	[PLAN_BOOT] = cmd_bootable,
+	[PLAN_FIND] = cmd_find,
+	[PLAN_PRIORITIZE] = cmd_prioritize,
+	[PLAN_LEGACY] = cmd_legacy,
+	[PLAN_RELOAD] = cmd_reload_indirect,
+};
 
-		strncpy(tokens[num_tokens], token, K_MAX_ARG_LEN);
-		num_tokens++;
+/* "add" entries are handed to cgpt_add() as compiled, the other
+ * commands still go through their cgpt command line parser. */
+static int oem_partition_gpt_sub_command(const struct plan_entry *e)
+{
+	char *argv[PLAN_ARGS_LEN / 2 + 1];
+	CgptAddParams params;
 
-		if (num_tokens == K_MAX_ARGS)
-			break;
+	if (e->command != PLAN_ADD) {
+		optind = 0;
+		return gpt_commands[e->command](partition_plan_argv(e, argv), argv);
 	}
 
-	*argc = num_tokens;
-	return tokens;
+	memset(&params, 0, sizeof(params));
+	params.drive_name = (char *)e->drive;
+	params.partition = e->partition;
+	params.begin = e->begin;
+	params.size = e->size;
+	if (e->flags & PLAN_SIZE_FROM_END)
+		params.size_unit = CGPT_SIZE_FROM_END;
+	else if (e->flags & PLAN_SIZE_BYTES)
+		params.size_unit = CGPT_SIZE_BYTES;
+	else if (e->flags & PLAN_SIZE_PERCENT)
+		params.size_unit = CGPT_SIZE_PERCENT;
+	params.type_guid = e->type_guid;
+	params.unique_guid = e->unique_guid;
+	params.label = (e->flags & PLAN_SET_LABEL) ? (char *)e->label : NULL;
+	params.successful = e->successful;
+	params.tries = e->tries;
+	params.priority = e->priority;
+	params.raw_value = e->raw_value;
+	params.set_begin = !!(e->flags & PLAN_SET_BEGIN);
+	params.set_size = !!(e->flags & PLAN_SET_SIZE);
+	params.begin_auto = !!(e->flags & PLAN_BEGIN_AUTO);
+	params.align = !!(e->flags & PLAN_ALIGN);
+	params.set_type = !!(e->flags & PLAN_SET_TYPE);
+	params.set_unique = !!(e->flags & PLAN_SET_UNIQUE);
+	params.set_successful = !!(e->flags & PLAN_SET_SUCCESSFUL);
+	params.set_tries = !!(e->flags & PLAN_SET_TRIES);
+	params.set_priority = !!(e->flags & PLAN_SET_PRIORITY);
+	params.set_raw = !!(e->flags & PLAN_SET_RAW);
+
+	return cgpt_add(&params);
 }
 
-static int (*indirected_cmd_reload) (int argc, char *argv[]) = cmd_reload;
-
-static int cmd_noop(int argc, char **argv)
+/* Route the table through a single in-memory GPT per drive: the drive is
+ * read once, every command edits that copy, and the result is written once
+ * when the table is done or right before a "reload" needs it on disk. */
+static int oem_partition_gpt_batch_command(const struct plan_entry *e, bool dry_run)
 {
-	return 0;
-}
+	const char *drive;
 
-void oem_partition_disable_cmd_reload()
-{
-	indirected_cmd_reload = cmd_noop;
+	if (!e->drive[0])
+		return oem_partition_gpt_sub_command(e);
+
+	if (e->command == PLAN_RELOAD) {
+		if (dry_run)
+			return 0;
+		if (CgptBatchCommit()) {
+			error("GPT commit failed\n");
+			return -1;
+		}
+		return oem_partition_gpt_sub_command(e);
+	}
+
+	drive = CgptBatchPath();
+	if (drive && strcmp(drive, e->drive)) {
+		if (dry_run)
+			CgptBatchAbort();
+		else if (CgptBatchCommit()) {
+			error("GPT commit of %s failed\n", drive);
+			return -1;
+		}
+	}
+
+	if (!CgptBatchPath() && CgptBatchBegin(e->drive, dry_run ? O_RDONLY : O_RDWR)) {
+		error("Can't load GPT from %s\n", e->drive);
+		return -1;
+	}
+
+	return oem_partition_gpt_sub_command(e);
 }
 
-static int oem_partition_gpt_sub_command(int argc, char **argv)
-{
-	unsigned int i;
-	char *command = argv[0];
-	struct {
-		const char *name;
-		int (*fp) (int argc, char *argv[]);
-	} cmds[] = {
-		{"create", cmd_create},
-		{"add", cmd_add},
-		{"dump", cmd_show},
-		{"repair", cmd_repair},
-		{"boot", cmd_bootable},
-		{"find", cmd_find},
-		{"prioritize", cmd_prioritize},
-		{"legacy", cmd_legacy},
-		{"reload", indirected_cmd_reload},
-	};
-
-	optind = 0;
-	for (i = 0; command && i < sizeof(cmds) / sizeof(cmds[0]); ++i)
-		if (0 == strncmp(cmds[i].name, command, strlen(command)))
-			return cmds[i].fp(argc, argv);
+static void oem_partition_gpt_show(void)
+{
+	CgptShowParams params;
 
-	return -1;
+	memset(&params, 0, sizeof(params));
+	params.drive_name = (char *)CgptBatchPath();
+	if (params.drive_name)
+		cgpt_show(&params);
 }
 
-static int oem_partition_gpt_handler(FILE *fp)
+static int oem_partition_gpt_handler(const struct partition_plan *plan, bool dry_run)
 {
-	int argc = 0;
-	int ret = 0;
-	int i;
-	char buffer[K_MAX_ARG_LEN];
-	char **argv = NULL;
 	char value[PROPERTY_VALUE_MAX] = { '\0' };
+	uint32_t i;
 
 	property_get("sys.partitioning", value, NULL);
-	if (strcmp(value, "1")) {
+	if (!dry_run && strcmp(value, "1")) {
 		error("Partitioning is not started\n");
 		return -1;
 	}
 
 	uuid_generator = uuid_generate;
-	while (fgets(buffer, sizeof(buffer), fp)) {
-		if (buffer[strlen(buffer) - 1] == '\n')
-			buffer[strlen(buffer) - 1] = '\0';
-		argv = str_to_array(buffer, &argc);
-
-		if (argv != NULL) {
-			ret = oem_partition_gpt_sub_command(argc, argv);
-
-			for (i = 0; i < argc; i++) {
-				if (argv[i]) {
-					free(argv[i]);
-					argv[i] = NULL;
-				}
-			}
-			free(argv);
-			argv = NULL;
-
-			if (ret) {
-				error("GPT command failed\n");
-				return -1;
-			}
-		} else {
-			error("GPT str_to_array error. Malformed string ?\n");
-			return -1;
+	for (i = 0; i < plan->count; i++) {
+		if (oem_partition_gpt_batch_command(&plan->entries[i], dry_run)) {
+			error("GPT command failed\n");
+			goto abort;
 		}
 	}
 
+	if (dry_run) {
+		print("Dry run, GPT left untouched\n");
+		oem_partition_gpt_show();
+		CgptBatchAbort();
+		return 0;
+	}
+
+	if (CgptBatchCommit()) {
+		error("GPT commit failed\n");
+		return -1;
+	}
+
 	return 0;
+
+abort:
+	CgptBatchAbort();
+	return -1;
 }
 
-static int oem_partition_mbr_handler(FILE *fp)
+static int oem_partition_mbr_handler(void)
 {
 	print("Using MBR\n");
 	return ufdisk.create_partition();
 }
 
+#define NUKE_PATTERN	0xFF
+#define NUKE_ALIGN	4096
+
+/* Returns true if the 'size' bytes of 'buf' all equal 'pattern' */
+static bool buffer_is_pattern(const unsigned char *buf, size_t size, unsigned char pattern)
+{
+	const uint64_t *words = (const uint64_t *)buf;
+	uint64_t ref, diff;
+	size_t i, count = size / sizeof(*words);
+
+	memset(&ref, pattern, sizeof(ref));
+	for (i = 0; i + 4 <= count; i += 4) {
+		diff = (words[i] ^ ref) | (words[i + 1] ^ ref) | (words[i + 2] ^ ref) | (words[i + 3] ^ ref);
+		if (diff)
+			return false;
+	}
+	for (; i < count; i++)
+		if (words[i] != ref)
+			return false;
+	for (i = count * sizeof(*words); i < size; i++)
+		if (buf[i] != pattern)
+			return false;
+
+	return true;
+}
+
+static void nuke_progress(const char *device, uint64_t done, uint64_t size, int *last)
+{
+	int percent = size ? done * 100 / size : 100;
+
+	if (percent / 10 != *last / 10) {
+		print("erasing \"%s\": %d%%\n", device, percent);
+		*last = percent;
+	}
+}
+
+/* Shared between the writer and the read-back thread of nuke_overwrite() */
+struct nuke_verify {
+	const char *device;
+	uint64_t size;
+	size_t chunk;
+	uint64_t written;
+	int error;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+/* Read back what the writer has already written, one chunk behind it */
+static void *nuke_verify_thread(void *arg)
+{
+	struct nuke_verify *nv = arg;
+	unsigned char *buf = NULL;
+	uint64_t offset;
+	size_t len;
+	int failed;
+	int fd;
+
+	fd = open(nv->device, O_RDONLY | O_DIRECT);
+	if (fd == -1 || posix_memalign((void **)&buf, NUKE_ALIGN, nv->chunk)) {
+		error("nuke_volume: can't set up read back of \"%s\"\n", nv->device);
+		goto out;
+	}
+
+	for (offset = 0; offset < nv->size; offset += len) {
+		len = nv->size - offset < nv->chunk ? nv->size - offset : nv->chunk;
+
+		pthread_mutex_lock(&nv->lock);
+		while (!nv->error && nv->written < offset + len)
+			pthread_cond_wait(&nv->cond, &nv->lock);
+		failed = nv->error;
+		pthread_mutex_unlock(&nv->lock);
+		if (failed)
+			goto out;
+
+		if (safe_pread(fd, buf, len, offset)) {
+			error("nuke_volume: failed to read data\n");
+			goto out;
+		}
+		if (!buffer_is_pattern(buf, len, NUKE_PATTERN)) {
+			error("nuke_volume failed read back check!! \"%s\" at %llu\n",
+			      nv->device, (unsigned long long)offset);
+			goto out;
+		}
+	}
+
+	free(buf);
+	close(fd);
+	return NULL;
+
+out:
+	free(buf);
+	if (fd != -1)
+		close(fd);
+	pthread_mutex_lock(&nv->lock);
+	nv->error = -1;
+	pthread_mutex_unlock(&nv->lock);
+	return NULL;
+}
+
+/* Overwrite the whole device with NUKE_PATTERN. Each chunk is read back
+ * and checked by a second thread while the next one is being written, so
+ * both passes overlap instead of running one after the other. */
+static int nuke_overwrite(int fd, const char *device, uint64_t size, size_t chunk)
+{
+	struct nuke_verify nv;
+	pthread_t thread;
+	unsigned char *pbuf = NULL;
+	uint64_t offset;
+	size_t len;
+	int last = 0;
+	int failed = 0;
+	int flags;
+	bool direct;
+	int ret = -1;
+
+	memset(&nv, 0, sizeof(nv));
+	nv.device = device;
+	nv.size = size;
+	nv.chunk = chunk;
+	pthread_mutex_init(&nv.lock, NULL);
+	pthread_cond_init(&nv.cond, NULL);
+
+	if (posix_memalign((void **)&pbuf, NUKE_ALIGN, chunk)) {
+		error("nuke_volume: malloc pbuf failed\n");
+		goto destroy;
+	}
+	memset(pbuf, NUKE_PATTERN, chunk);
+
+	/* Keep the pattern out of the page cache, the read back must hit the
+	 * device. Without O_DIRECT each chunk is synced before it is handed
+	 * to the read back thread. */
+	flags = fcntl(fd, F_GETFL);
+	direct = flags != -1 && fcntl(fd, F_SETFL, flags | O_DIRECT) != -1;
+	if (!direct)
+		print("nuke_volume: no direct I/O on \"%s\", syncing every chunk\n", device);
+
+	if (pthread_create(&thread, NULL, nuke_verify_thread, &nv)) {
+		error("nuke_volume: can't start read back thread\n");
+		goto free;
+	}
+
+	for (offset = 0; offset < size && !failed; offset += len) {
+		len = size - offset < chunk ? size - offset : chunk;
+
+		if (safe_pwrite(fd, pbuf, len, offset)) {
+			error("nuke_volume: failed to write file\n");
+			break;
+		}
+		if (!direct && fdatasync(fd)) {
+			error("nuke_volume: failed to sync file\n");
+			break;
+		}
+
+		pthread_mutex_lock(&nv.lock);
+		nv.written = offset + len;
+		failed = nv.error;
+		pthread_cond_signal(&nv.cond);
+		pthread_mutex_unlock(&nv.lock);
+
+		nuke_progress(device, offset + len, size, &last);
+	}
+
+	pthread_mutex_lock(&nv.lock);
+	if (offset < size || fsync(fd))
+		nv.error = -1;
+	pthread_cond_signal(&nv.cond);
+	pthread_mutex_unlock(&nv.lock);
+
+	pthread_join(thread, NULL);
+	if (!nv.error) {
+		print("wrote and read back %llu bytes \"%s\"\n", (unsigned long long)size, device);
+		ret = 0;
+	}
+
+free:
+	free(pbuf);
+destroy:
+	pthread_cond_destroy(&nv.cond);
+	pthread_mutex_destroy(&nv.lock);
+	return ret;
+}
+
+/* Check that a discarded device reads back as all 0x00 or all 0xFF */
+static int nuke_check_discarded(const char *device, uint64_t size, size_t chunk)
+{
+	unsigned char *buf = NULL;
+	uint64_t offset;
+	size_t len;
+	int ret = -1;
+	int fd;
+
+	fd = open(device, O_RDONLY | O_DIRECT);
+	if (fd == -1)
+		return -1;
+	if (posix_memalign((void **)&buf, NUKE_ALIGN, chunk))
+		goto out;
+
+	for (offset = 0; offset < size; offset += len) {
+		len = size - offset < chunk ? size - offset : chunk;
+		if (safe_pread(fd, buf, len, offset))
+			goto out;
+		if ((buf[0] != 0x00 && buf[0] != 0xFF) || !buffer_is_pattern(buf, len, buf[0]))
+			goto out;
+	}
+	ret = 0;
+
+out:
+	free(buf);
+	close(fd);
+	return ret;
+}
+
+/* Let the device erase itself when it can. A secure discard or a zero out
+ * is trusted as is, a plain discard only once the device reads back
+ * uniformly erased. */
+static int nuke_discard(int fd, const char *device, uint64_t size, size_t chunk)
+{
+	uint64_t range[2] = { 0, size };
+
+	if (!ioctl(fd, BLKSECDISCARD, &range)) {
+		print("secure discard of \"%s\" done\n", device);
+		return 0;
+	}
+
+	if (!ioctl(fd, BLKDISCARD, &range)) {
+		if (!nuke_check_discarded(device, size, chunk)) {
+			print("discard of \"%s\" done\n", device);
+			return 0;
+		}
+		print("discard of \"%s\" left data behind\n", device);
+	}
+
+	if (!ioctl(fd, BLKZEROOUT, &range)) {
+		print("zero out of \"%s\" done\n", device);
+		return 0;
+	}
+
+	return -1;
+}
+
 static int nuke_volume(const char *volume, long int bufferSize)
 {
 	Volume *v = volume_for_path(volume);
-	int fd, count, count_w, offset;
-	char *pbuf = NULL, *pbufRead = NULL;
-	long int ret, retval;
+	uint64_t start;
+	int fd;
+	long int ret;
 	long long size;
+	size_t chunk = bufferSize - bufferSize % NUKE_ALIGN;
 
 	if (v == NULL) {
 		error("unknown volume \"%s\"\n", volume);
@@ -202,105 +502,33 @@ static int nuke_volume(const char *volume, long int bufferSize)
 		return -1;
 	}
 
-	pbuf = (char *)malloc(bufferSize);
-	if (pbuf == NULL) {
-		error("nuke_volume: malloc pbuf failed\n");
-		ret = -1;
-		goto end3;
-	}
-
-	pbufRead = (char *)malloc(bufferSize);
-	if (pbufRead == NULL) {
-		error("nuke_volume: malloc pbufRead failed\n");
-		ret = -1;
-		goto end2;
-	}
-
-	memset(pbuf, 0xFF, bufferSize * sizeof(char));
-
 	size = lseek64(fd, 0, SEEK_END);
 
 	if (size == -1) {
 		error("nuke_volume: lseek64 fd failed\n");
 		ret = -1;
-		goto end1;
-	}
-
-	offset = lseek(fd, 0, SEEK_SET);
-
-	if (offset == -1) {
-		error("nuke_volume: lseek fd failed");
-		ret = -1;
-		goto end1;
+		goto end;
 	}
 
 	print("erasing volume \"%s\", size=%lld...\n", volume, size);
 
-	//now blast the device with F's until we hit the end.
-	count = 0;
-	do {
-		ret = write(fd, pbuf, bufferSize);
-
-		if (ret == -1) {
-			error("nuke_volume: failed to write file");
-			goto end1;
-		}
-
-		count++;
-	} while (ret == bufferSize);
-
-	print("wrote ret %ld, count %d,  \"%s\"\n", ret, count, v->device);
-
-	//now do readback check that data is as expected
-	offset = lseek(fd, 0, SEEK_SET);
-
-	if (offset == -1) {
-		error("nuke_volume: lseek check data failed");
-		goto end1;
-	}
-
-	count_w = count;
-	count = 0;
-	do {
-		ret = read(fd, pbufRead, bufferSize);
-
-		if (ret <= 0) {
-			error("nuke_volume: failed to read data");
-			goto end1;
-		}
-
-		retval = memcmp(pbuf, pbufRead, bufferSize);
-		count++;
-		if (retval != 0) {
-			error("nuke_volume failed read back check!! \"%s\"\n", v->device);
-			ret = -1;
-			goto end1;
-		}
-	} while (ret == bufferSize);
-
-	if (count != count_w) {
-		error("nuke_volume: failed read back check, bad count %d\n", count);
-		ret = -1;
-		goto end1;
-	}
+	start = perf_now();
+	ret = nuke_discard(fd, v->device, size, chunk);
+	if (ret)
+		ret = nuke_overwrite(fd, v->device, size, chunk);
+	perf_add(PERF_WRITE, start, ret ? 0 : size);
 
-	print("read back ret %ld, count %d \"%s\"\n", ret, count, v->device);
-	ret = 0;
-
-end1:
-	free(pbufRead);
-end2:
-	free(pbuf);
-end3:
+end:
+	start = perf_now();
 	sync();
+	perf_add(PERF_FSYNC, start, 0);
 	close(fd);
-	pbuf = NULL;
-	pbufRead = NULL;
 	return ret;
 }
 
 int oem_partition_start_handler(int argc, char **argv)
 {
+	erase_queue_wait(NULL);
 	property_set("sys.partitioning", "1");
 	print("Start partitioning\n");
 	ufdisk.umount_all();
@@ -316,96 +544,81 @@ int oem_partition_stop_handler(int argc, char **argv)
 	return 0;
 }
 
-int oem_partition_cmd_handler(int argc, char **argv)
+int oem_partition_apply_plan(const struct partition_plan *plan, bool dry_run)
 {
-	char buffer[K_MAX_ARG_LEN];
-	char partition_type[K_MAX_ARG_LEN];
-	FILE *fp;
 	int retval = -1;
 
-	memset(buffer, 0, sizeof(buffer));
+	if (!dry_run)
+		erase_queue_wait(NULL);
 
-	if (argc == 2) {
-		fp = fopen(argv[1], "r");
-		if (!fp) {
-			error("Can't open partition file");
-			return -1;
-		}
+	if (!strncmp("gpt", plan->type, strlen(plan->type)))
+		retval = oem_partition_gpt_handler(plan, dry_run);
 
-		if (!fgets(buffer, sizeof(buffer), fp)) {
-			error("partition file is empty");
-			return -1;
-		}
+	if (!strncmp("mbr", plan->type, strlen(plan->type)))
+		retval = oem_partition_mbr_handler();
 
-		buffer[strlen(buffer) - 1] = '\0';
+	/* The first LBA and the partition labels the backends are
+	 * probed with may have changed */
+	if (!dry_run) {
+		flush_osip_cache();
+		flash_ops_reset();
+	}
 
-		if (sscanf(buffer, "%*[^=]=%255s", partition_type) != 1) {
-			error("partition file is invalid");
-			return -1;
-		}
+	return retval;
+}
 
-		if (!strncmp("gpt", partition_type, strlen(partition_type)))
-			retval = oem_partition_gpt_handler(fp);
+/* oem partition <file> [--dry-run]
+ * oem partition <file> --save-plan <plan>
+ *
+ * <file> is either a partition.tbl or a plan saved with --save-plan,
+ * which skips the text parsing altogether. */
+int oem_partition_cmd_handler(int argc, char **argv)
+{
+	struct partition_plan *plan;
+	bool dry_run = false;
+	int retval = -1;
 
-		if (!strncmp("mbr", partition_type, strlen(partition_type)))
-			retval = oem_partition_mbr_handler(fp);
+	if (argc == 3 && !strcmp(argv[2], "--dry-run"))
+		dry_run = true;
+	else if (!(argc == 2 || (argc == 4 && !strcmp(argv[2], "--save-plan"))))
+		return -1;
 
-		fclose(fp);
-	}
+	plan = partition_plan_load(argv[1]);
+	if (!plan)
+		return -1;
+
+	if (argc == 4)
+		retval = partition_plan_save(plan, argv[3]);
+	else
+		retval = oem_partition_apply_plan(plan, dry_run);
 
+	free(plan);
 	return retval;
 }
 
-#define MOUNT_POINT_SIZE    50	/* /dev/<whatever> */
+#define MOUNT_POINT_SIZE    ERASE_KEY_LEN	/* /dev/<whatever> */
 #define BUFFER_SIZE         4000000	/* 4Mb */
 
+/* The erase queue keys its jobs by the same mount point */
 static int get_mountpoint(char *name, char *mnt_point)
 {
-	int size;
-	if (name[0] == '/') {
-		size = snprintf(mnt_point, MOUNT_POINT_SIZE, "%s", name);
-
-		if (size == -1 || size > MOUNT_POINT_SIZE - 1) {
-			error("Mount point parameter size exceeds limit");
-			return -1;
-		}
-	} else {
-		if (!strcmp(name, "userdata")) {
-			strcpy(mnt_point, "/data");
-		} else {
-			size = snprintf(mnt_point, MOUNT_POINT_SIZE, "/%s", name);
-
-			if (size == -1 || size > MOUNT_POINT_SIZE - 1) {
-				error("Mount point size exceeds limit");
-				return -1;
-			}
-		}
+	if (erase_queue_key(name, mnt_point, MOUNT_POINT_SIZE)) {
+		error("Mount point size exceeds limit");
+		return -1;
 	}
 
 	return 0;
 }
 
-int oem_erase_partition(int argc, char **argv)
+static int erase_volume(const char *mnt_point)
 {
-	int retval = -1;
-	char mnt_point[MOUNT_POINT_SIZE] = "";
-
-	if (argc != 2) {
-		/* Should not pass here ! */
-		error("oem erase called with wrong parameter!");
-		goto end;
-	}
-
-	if (get_mountpoint(argv[1], mnt_point))
-		goto end;
-
-	print("CMD '%s %s'...\n", argv[0], mnt_point);
+	int retval;
 
 	print("ERASE step 1/2...\n");
 	retval = nuke_volume(mnt_point, BUFFER_SIZE);
 	if (retval != 0) {
 		error("format_volume failed: %s\n", mnt_point);
-		goto end;
+		return retval;
 	} else {
 		print("format_volume succeeds: %s\n", mnt_point);
 	}
@@ -418,10 +631,68 @@ int oem_erase_partition(int argc, char **argv)
 		print("format_volume succeeds: %s\n", mnt_point);
 	}
 
-end:
 	return retval;
 }
 
+static int wipe_volume(const char *mnt_point)
+{
+	int retval;
+
+	retval = nuke_volume(mnt_point, BUFFER_SIZE);
+	if (retval != 0)
+		error("wipe partition failed: %s\n", mnt_point);
+
+	return retval;
+}
+
+/* oem erase|wipe <partition> [--background]
+ *
+ * With --background the erase is queued and the command returns at once;
+ * oem erase_status tells when it is over. Flashing the same partition
+ * waits for it. The volume code (roots, make_ext4fs) is not reentrant, so
+ * a synchronous erase, like repartitioning, waits for every erase. */
+static int oem_erase_cmd(int argc, char **argv, erase_fn fn)
+{
+	char mnt_point[MOUNT_POINT_SIZE] = "";
+
+	if ((argc != 2 && argc != 3) || (argc == 3 && strcmp(argv[2], "--background"))) {
+		/* Should not pass here ! */
+		error("oem %s called with wrong parameter!", argv[0]);
+		return -1;
+	}
+
+	if (get_mountpoint(argv[1], mnt_point))
+		return -1;
+
+	if (argc == 3)
+		return erase_queue_add(mnt_point, fn, mnt_point);
+
+	erase_queue_wait(NULL);
+	print("CMD '%s %s'...\n", argv[0], mnt_point);
+	return fn(mnt_point);
+}
+
+int oem_erase_partition(int argc, char **argv)
+{
+	return oem_erase_cmd(argc, argv, erase_volume);
+}
+
+static void erase_status_line(const char *line)
+{
+	print("%s\n", line);
+}
+
+/* oem erase_status [<partition>] */
+int oem_erase_status(int argc, char **argv)
+{
+	if (argc > 2) {
+		error("oem erase_status takes at most one argument");
+		return -1;
+	}
+
+	return erase_queue_status(argc == 2 ? argv[1] : NULL, erase_status_line);
+}
+
 int oem_repart_partition(int argc, char **argv)
 {
 	int retval = -1;
@@ -432,6 +703,7 @@ int oem_repart_partition(int argc, char **argv)
 		goto end;
 	}
 
+	erase_queue_wait(NULL);
 	retval = ufdisk.create_partition();
 	if (retval != 0)
 		error("cannot write partition");
@@ -471,7 +743,7 @@ int oem_retrieve_partitions(int argc, char **argv)
 
 	reload_argv[1] = drive;
 	printf("reload %s\n", reload_argv[1]);
-	ret = cmd_reload(2, reload_argv);
+	ret = cmd_reload_and_invalidate(2, reload_argv);
 	if (ret) {
 		error("gpt reload command failed\n");
 		return ret;
@@ -494,23 +766,5 @@ void oem_partition_init(struct ufdisk *new_ufdisk)
 
 int oem_wipe_partition(int argc, char **argv)
 {
-	int retval = -1;
-	char mnt_point[MOUNT_POINT_SIZE] = "";
-
-	if (argc != 2) {
-		error("oem erase called with wrong parameter!");
-		goto end;
-	}
-
-	if (get_mountpoint(argv[1], mnt_point))
-		goto end;
-
-	print("CMD '%s %s'...\n", argv[0], mnt_point);
-
-	retval = nuke_volume(mnt_point, BUFFER_SIZE);
-	if (retval != 0)
-		error("wipe partition failed: %s\n", mnt_point);
-
-end:
-	return retval;
+	return oem_erase_cmd(argc, argv, wipe_volume);
 }
@@ -17,6 +17,8 @@
 #ifndef _OEM_PARTITION_H_
 #define _OEM_PARTITION_H_
 
+#include <stdbool.h>
+
 #define K_MAX_LINE_LEN 8192
 #define K_MAX_ARGS 256
 #define K_MAX_ARG_LEN 256
@@ -28,8 +30,11 @@ int oem_erase_partition(int argc, char **argv);
 int oem_repart_partition(int argc, char **argv);
 int oem_retrieve_partitions(int argc, char **argv);
 int oem_wipe_partition(int argc, char **argv);
+int oem_erase_status(int argc, char **argv);
 void oem_partition_disable_cmd_reload();
-char **str_to_array(char *str, int *argc);
+
+struct partition_plan;
+int oem_partition_apply_plan(const struct partition_plan *plan, bool dry_run);
 
 struct ufdisk {
 	void (*umount_all) (void);
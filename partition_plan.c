@@ -0,0 +1,456 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <cgpt_params.h>
+
+#include "oem_partition.h"
+#include "partition_plan.h"
+#include "util.h"
+
+struct partition_plan_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_size;
+	uint32_t count;
+	char type[8];
+};
+
+static const char *const command_names[PLAN_COMMANDS] = {
+	[PLAN_CREATE] = "create",
+	[PLAN_ADD] = "add",
+	[PLAN_DUMP] = "dump",
+	[PLAN_REPAIR] = "repair",
+	[PLAN_BOOT] = "boot",
+	[PLAN_FIND] = "find",
+	[PLAN_PRIORITIZE] = "prioritize",
+	[PLAN_LEGACY] = "legacy",
+	[PLAN_RELOAD] = "reload",
+};
+
+/* Commands may be abbreviated, as with the cgpt tool */
+static int plan_command(const char *name)
+{
+	int i;
+
+	for (i = 0; i < PLAN_COMMANDS; i++)
+		if (!strncmp(command_names[i], name, strlen(name)))
+			return i;
+	return -1;
+}
+
+static int parse_number(const char *str, uint64_t *value)
+{
+	char *end;
+
+	errno = 0;
+	*value = strtoull(str, &end, 0);
+	return !*str || *end || errno ? -1 : 0;
+}
+
+static int parse_range(const char *str, uint32_t max, uint32_t *value)
+{
+	uint64_t v;
+
+	if (parse_number(str, &v) || v > max)
+		return -1;
+	*value = v;
+	return 0;
+}
+
+/* The options of "add" are those of cmd_add() */
+static int compile_add(struct plan_entry *e, int argc, char **argv)
+{
+	uint64_t v;
+	int unit;
+	int c;
+
+	optind = 0;
+	opterr = 0;
+	while ((c = getopt(argc, argv, ":ai:b:s:t:u:l:S:T:P:A:")) != -1) {
+		switch (c) {
+		case 'i':
+			if (parse_range(optarg, UINT32_MAX, &e->partition))
+				goto invalid;
+			e->flags |= PLAN_SET_PARTITION;
+			break;
+		case 'a':
+			e->flags |= PLAN_ALIGN;
+			break;
+		case 'b':
+			if (!strcmp(optarg, "auto")) {
+				e->flags |= PLAN_BEGIN_AUTO;
+				break;
+			}
+			if (parse_number(optarg, &e->begin))
+				goto invalid;
+			e->flags |= PLAN_SET_BEGIN;
+			break;
+		case 's':
+			if (ParseSize(optarg, &e->size, &unit) != CGPT_OK)
+				goto invalid;
+			if (unit == CGPT_SIZE_FROM_END)
+				e->flags |= PLAN_SIZE_FROM_END;
+			else if (unit == CGPT_SIZE_BYTES)
+				e->flags |= PLAN_SIZE_BYTES;
+			else if (unit == CGPT_SIZE_PERCENT)
+				e->flags |= PLAN_SIZE_PERCENT;
+			e->flags |= PLAN_SET_SIZE;
+			break;
+		case 't':
+			if (SupportedType(optarg, &e->type_guid) != CGPT_OK &&
+			    StrToGuid(optarg, &e->type_guid) != CGPT_OK)
+				goto invalid;
+			e->flags |= PLAN_SET_TYPE;
+			break;
+		case 'u':
+			if (StrToGuid(optarg, &e->unique_guid) != CGPT_OK)
+				goto invalid;
+			e->flags |= PLAN_SET_UNIQUE;
+			break;
+		case 'l':
+			if (strlen(optarg) >= sizeof(e->label))
+				goto invalid;
+			strcpy(e->label, optarg);
+			e->flags |= PLAN_SET_LABEL;
+			break;
+		case 'S':
+			if (parse_range(optarg, 1, &e->successful))
+				goto invalid;
+			e->flags |= PLAN_SET_SUCCESSFUL;
+			break;
+		case 'T':
+			if (parse_range(optarg, 15, &e->tries))
+				goto invalid;
+			e->flags |= PLAN_SET_TRIES;
+			break;
+		case 'P':
+			if (parse_range(optarg, 15, &e->priority))
+				goto invalid;
+			e->flags |= PLAN_SET_PRIORITY;
+			break;
+		case 'A':
+			if (parse_number(optarg, &v))
+				goto invalid;
+			e->raw_value = v;
+			e->flags |= PLAN_SET_RAW;
+			break;
+		default:
+			error("partition plan: bad option -%c in add\n", optopt);
+			return -1;
+		}
+	}
+
+	if (optind >= argc) {
+		error("partition plan: missing drive in add\n");
+		return -1;
+	}
+	return 0;
+
+invalid:
+	error("partition plan: invalid argument to -%c: \"%s\"\n", c, optarg);
+	return -1;
+}
+
+static int compile_line(struct plan_entry *e, char *line)
+{
+	char *argv[PLAN_ARGS_LEN / 2 + 1];
+	char *saveptr, *token, *p;
+	int argc = 0;
+	int command;
+	int i;
+
+	for (token = strtok_r(line, " ", &saveptr); token; token = strtok_r(NULL, " ", &saveptr)) {
+		if (argc == PLAN_ARGS_LEN / 2)
+			return -1;
+		argv[argc++] = token;
+	}
+	argv[argc] = NULL;
+
+	command = plan_command(argv[0]);
+	if (command < 0) {
+		error("partition plan: unknown command %s\n", argv[0]);
+		return -1;
+	}
+
+	memset(e, 0, sizeof(*e));
+	e->command = command;
+	e->argc = argc;
+	for (i = 0, p = e->args; i < argc; i++) {
+		if (p + strlen(argv[i]) + 1 > e->args + sizeof(e->args))
+			return -1;
+		p = stpcpy(p, argv[i]) + 1;
+	}
+
+	if (argc >= 2) {
+		if (strlen(argv[argc - 1]) >= sizeof(e->drive))
+			return -1;
+		strcpy(e->drive, argv[argc - 1]);
+	}
+
+	return command == PLAN_ADD ? compile_add(e, argc, argv) : 0;
+}
+
+/* Compile a partition.tbl: a "partition_table=<type>" line followed by
+ * one GPT command per line. */
+struct partition_plan *partition_plan_compile(FILE *fp)
+{
+	struct partition_plan *plan;
+	char buffer[K_MAX_ARG_LEN];
+	char type[K_MAX_ARG_LEN];
+	size_t len;
+
+	plan = calloc(1, sizeof(*plan));
+	if (!plan) {
+		error("partition plan: out of memory\n");
+		return NULL;
+	}
+
+	if (!fgets(buffer, sizeof(buffer), fp)) {
+		error("partition file is empty\n");
+		goto err;
+	}
+	if (sscanf(buffer, "%*[^=]=%255s", type) != 1) {
+		error("partition file is invalid\n");
+		goto err;
+	}
+	strncpy(plan->type, type, sizeof(plan->type) - 1);
+
+	while (fgets(buffer, sizeof(buffer), fp)) {
+		len = strlen(buffer);
+		if (len && buffer[len - 1] == '\n')
+			buffer[--len] = '\0';
+		if (strspn(buffer, " ") == len)
+			continue;
+
+		if (plan->count == PLAN_MAX_ENTRIES) {
+			error("partition plan: too many commands\n");
+			goto err;
+		}
+		if (compile_line(&plan->entries[plan->count], buffer)) {
+			error("partition plan: can't compile line %u\n", plan->count + 2);
+			goto err;
+		}
+		plan->count++;
+	}
+
+	return plan;
+
+err:
+	free(plan);
+	return NULL;
+}
+
+/* A binary plan is trusted no further than what the code using it
+ * relies on: a known command, and strings that end within their field,
+ * argc of them in args. */
+static bool plan_entry_valid(const struct plan_entry *entry)
+{
+	const char *p = entry->args;
+	const char *end = entry->args + sizeof(entry->args);
+	const char *nul;
+	uint32_t i;
+
+	if (entry->command >= PLAN_COMMANDS || entry->argc > PLAN_ARGS_LEN / 2 ||
+	    !memchr(entry->label, '\0', sizeof(entry->label)) ||
+	    !memchr(entry->drive, '\0', sizeof(entry->drive)))
+		return false;
+
+	for (i = 0; i < entry->argc; i++) {
+		nul = memchr(p, '\0', end - p);
+		if (!nul)
+			return false;
+		p = nul + 1;
+	}
+	return true;
+}
+
+static struct partition_plan *plan_read_binary(FILE *fp)
+{
+	struct partition_plan_header hdr;
+	struct partition_plan *plan;
+	uint32_t i;
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    hdr.version != PARTITION_PLAN_VERSION ||
+	    hdr.entry_size != sizeof(struct plan_entry) || hdr.count > PLAN_MAX_ENTRIES) {
+		error("partition plan: unsupported binary plan\n");
+		return NULL;
+	}
+
+	plan = calloc(1, sizeof(*plan));
+	if (!plan) {
+		error("partition plan: out of memory\n");
+		return NULL;
+	}
+
+	memcpy(plan->type, hdr.type, sizeof(plan->type));
+	plan->type[sizeof(plan->type) - 1] = '\0';
+	plan->count = hdr.count;
+	if (fread(plan->entries, sizeof(struct plan_entry), plan->count, fp) != plan->count) {
+		error("partition plan: truncated binary plan\n");
+		free(plan);
+		return NULL;
+	}
+
+	for (i = 0; i < plan->count; i++) {
+		if (!plan_entry_valid(&plan->entries[i])) {
+			error("partition plan: invalid entry %u in binary plan\n", i);
+			free(plan);
+			return NULL;
+		}
+	}
+
+	return plan;
+}
+
+/* The last plan loaded is kept, as long as its file does not change:
+ * an update script looking up several partitions in the same table
+ * only has it compiled once. */
+static struct {
+	char path[PATH_MAX];
+	struct stat st;
+	struct partition_plan *plan;
+} cache;
+
+static bool cache_hit(const char *path, const struct stat *st)
+{
+	return cache.plan && !strcmp(cache.path, path) &&
+	    cache.st.st_dev == st->st_dev && cache.st.st_ino == st->st_ino &&
+	    cache.st.st_size == st->st_size && cache.st.st_mtime == st->st_mtime;
+}
+
+/* Load a binary plan, or compile a text partition table. The returned
+ * plan belongs to the caller, who may edit it and must free() it. */
+struct partition_plan *partition_plan_load(const char *path)
+{
+	struct partition_plan *plan;
+	char magic[sizeof(((struct partition_plan_header *)0)->magic)];
+	struct stat st;
+	bool cacheable;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		error("Can't open partition file %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	cacheable = fstat(fileno(fp), &st) == 0 && strlen(path) < sizeof(cache.path);
+	if (cacheable && cache_hit(path, &st)) {
+		fclose(fp);
+		goto copy;
+	}
+
+	if (fread(magic, sizeof(magic), 1, fp) == 1 && !memcmp(magic, PARTITION_PLAN_MAGIC, sizeof(magic))) {
+		rewind(fp);
+		plan = plan_read_binary(fp);
+	} else {
+		rewind(fp);
+		plan = partition_plan_compile(fp);
+	}
+	fclose(fp);
+
+	if (!plan || !cacheable)
+		return plan;
+
+	free(cache.plan);
+	strcpy(cache.path, path);
+	cache.st = st;
+	cache.plan = plan;
+
+copy:
+	plan = malloc(sizeof(*plan));
+	if (!plan) {
+		error("partition plan: out of memory\n");
+		return NULL;
+	}
+	memcpy(plan, cache.plan, sizeof(*plan));
+	return plan;
+}
+
+int partition_plan_save(const struct partition_plan *plan, const char *path)
+{
+	struct partition_plan_header hdr;
+	FILE *fp;
+	int ret = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PARTITION_PLAN_MAGIC, sizeof(hdr.magic));
+	hdr.version = PARTITION_PLAN_VERSION;
+	hdr.entry_size = sizeof(struct plan_entry);
+	hdr.count = plan->count;
+	memcpy(hdr.type, plan->type, sizeof(hdr.type));
+
+	fp = fopen(path, "w");
+	if (!fp) {
+		error("Can't create %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    fwrite(plan->entries, sizeof(struct plan_entry), plan->count, fp) != plan->count) {
+		error("Can't write %s: %s\n", path, strerror(errno));
+		ret = -1;
+	}
+
+	if (fclose(fp))
+		ret = -1;
+	return ret;
+}
+
+/* Returns the "add" entry of the partition labelled label */
+struct plan_entry *partition_plan_find(struct partition_plan *plan, const char *label)
+{
+	uint32_t i;
+
+	for (i = 0; i < plan->count; i++)
+		if (plan->entries[i].command == PLAN_ADD &&
+		    (plan->entries[i].flags & PLAN_SET_LABEL) &&
+		    !strcmp(plan->entries[i].label, label))
+			return &plan->entries[i];
+	return NULL;
+}
+
+void partition_plan_remove(struct partition_plan *plan, struct plan_entry *entry)
+{
+	uint32_t i = entry - plan->entries;
+
+	memmove(entry, entry + 1, (plan->count - i - 1) * sizeof(*entry));
+	plan->count--;
+}
+
+/* Point argv at the arguments of entry, NULL terminated. argv must have
+ * room for PLAN_ARGS_LEN / 2 + 1 pointers. */
+int partition_plan_argv(const struct plan_entry *entry, char **argv)
+{
+	char *p = (char *)entry->args;
+	uint32_t i;
+
+	for (i = 0; i < entry->argc; i++) {
+		argv[i] = p;
+		p += strlen(p) + 1;
+	}
+	argv[i] = NULL;
+	return entry->argc;
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PARTITION_PLAN_H_
+#define _PARTITION_PLAN_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <cgpt.h>
+
+/* A partition plan is partition.tbl compiled once: every line becomes a
+ * fixed size entry, and "add" lines have their options already parsed
+ * into the values cgpt_add() takes. Plans can be saved in binary form
+ * and loaded back as is. */
+
+#define PARTITION_PLAN_MAGIC	"PARTPLAN"
+#define PARTITION_PLAN_VERSION	1
+#define PLAN_MAX_ENTRIES	128
+#define PLAN_DRIVE_LEN		128
+#define PLAN_ARGS_LEN		256
+
+/* Same order as the GPT sub-commands of oem_partition.c */
+enum plan_command {
+	PLAN_CREATE,
+	PLAN_ADD,
+	PLAN_DUMP,
+	PLAN_REPAIR,
+	PLAN_BOOT,
+	PLAN_FIND,
+	PLAN_PRIORITIZE,
+	PLAN_LEGACY,
+	PLAN_RELOAD,
+	PLAN_COMMANDS
+};
+
+/* plan_entry flags, for PLAN_ADD */
+#define PLAN_SET_PARTITION	(1 << 0)
+#define PLAN_SET_BEGIN		(1 << 1)
+#define PLAN_SET_SIZE		(1 << 2)
+#define PLAN_SIZE_FROM_END	(1 << 3)	/* size is $calc($lba_end-size) */
+#define PLAN_SET_TYPE		(1 << 4)
+#define PLAN_SET_UNIQUE		(1 << 5)
+#define PLAN_SET_LABEL		(1 << 6)
+#define PLAN_SET_SUCCESSFUL	(1 << 7)
+#define PLAN_SET_TRIES		(1 << 8)
+#define PLAN_SET_PRIORITY	(1 << 9)
+#define PLAN_SET_RAW		(1 << 10)
+#define PLAN_SIZE_BYTES		(1 << 11)	/* size is in bytes */
+#define PLAN_SIZE_PERCENT	(1 << 12)	/* size is a percentage of the drive */
+#define PLAN_BEGIN_AUTO		(1 << 13)	/* begin after the last partition */
+#define PLAN_ALIGN		(1 << 14)	/* align to the drive erase unit */
+#define PLAN_SIZE_UNITS		(PLAN_SIZE_FROM_END | PLAN_SIZE_BYTES | PLAN_SIZE_PERCENT)
+
+struct plan_entry {
+	uint32_t command;		/* enum plan_command */
+	uint32_t flags;
+	uint32_t partition;
+	uint32_t successful;
+	uint32_t tries;
+	uint32_t priority;
+	uint64_t begin;			/* in sectors */
+	uint64_t size;			/* in sectors unless PLAN_SIZE_UNITS */
+	Guid type_guid;
+	Guid unique_guid;
+	uint16_t raw_value;
+	char label[GPT_PARTNAME_LEN];
+	char drive[PLAN_DRIVE_LEN];	/* last argument of the line */
+	/* All the arguments as NUL separated strings, for the commands
+	 * that are not compiled */
+	uint32_t argc;
+	char args[PLAN_ARGS_LEN];
+};
+
+struct partition_plan {
+	char type[8];			/* "gpt" or "mbr" */
+	uint32_t count;
+	struct plan_entry entries[PLAN_MAX_ENTRIES];
+};
+
+struct partition_plan *partition_plan_compile(FILE *fp);
+struct partition_plan *partition_plan_load(const char *path);
+int partition_plan_save(const struct partition_plan *plan, const char *path);
+struct plan_entry *partition_plan_find(struct partition_plan *plan, const char *label);
+void partition_plan_remove(struct partition_plan *plan, struct plan_entry *entry);
+int partition_plan_argv(const struct plan_entry *entry, char **argv);
+
+#endif	/* _PARTITION_PLAN_H_ */
@@ -0,0 +1,146 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "perf.h"
+#include "util.h"
+
+static const char *const phase_names[PERF_PHASES] = {
+	[PERF_PROBE] = "probe",
+	[PERF_READ] = "read",
+	[PERF_VERIFY] = "verify",
+	[PERF_WRITE] = "write",
+	[PERF_FSYNC] = "fsync",
+};
+
+/* The last PERF_RING_SIZE commands, oldest at ring[next] once full. A
+ * command may run other timed commands (an updater function calling a
+ * droidboot handler), only the outermost one is recorded. */
+static pthread_mutex_t perf_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct perf_record ring[PERF_RING_SIZE];
+static unsigned int next, count;
+static struct perf_record current;
+static uint64_t current_start;
+static unsigned int depth;
+
+uint64_t perf_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void perf_begin(const char *name)
+{
+	pthread_mutex_lock(&perf_lock);
+	if (!depth++) {
+		memset(&current, 0, sizeof(current));
+		strncpy(current.name, name, sizeof(current.name) - 1);
+		current_start = perf_now();
+	}
+	pthread_mutex_unlock(&perf_lock);
+}
+
+/* Returns true if this ended the outermost command, now in the ring */
+bool perf_end(int ret)
+{
+	bool recorded = false;
+
+	pthread_mutex_lock(&perf_lock);
+	if (depth && !--depth) {
+		current.ret = ret;
+		current.total_us = perf_now() - current_start;
+		ring[next] = current;
+		next = (next + 1) % PERF_RING_SIZE;
+		if (count < PERF_RING_SIZE)
+			count++;
+		recorded = true;
+	}
+	pthread_mutex_unlock(&perf_lock);
+	return recorded;
+}
+
+/* Accounts the time since start_us, a perf_now() value, and bytes to
+ * phase of the running command. Does nothing outside of a command, or
+ * from a background thread that is not working for it. */
+void perf_add(enum perf_phase phase, uint64_t start_us, uint64_t bytes)
+{
+	uint64_t us = perf_now() - start_us;
+
+	if (util_in_background())
+		return;
+
+	pthread_mutex_lock(&perf_lock);
+	if (depth) {
+		current.us[phase] += us;
+		current.bytes[phase] += bytes;
+	}
+	pthread_mutex_unlock(&perf_lock);
+}
+
+/* Copies up to max of the last commands, oldest first */
+unsigned int perf_records(struct perf_record *records, unsigned int max)
+{
+	unsigned int i, n;
+
+	pthread_mutex_lock(&perf_lock);
+	n = count < max ? count : max;
+	for (i = 0; i < n; i++)
+		records[i] = ring[(next + PERF_RING_SIZE - n + i) % PERF_RING_SIZE];
+	pthread_mutex_unlock(&perf_lock);
+	return n;
+}
+
+/* One short line for the command and one per phase it spent time in,
+ * short enough for a fastboot INFO reply */
+void perf_report(const struct perf_record *record, void (*out) (const char *line))
+{
+	char line[64];
+	unsigned int i;
+
+	snprintf(line, sizeof(line), "%s: %llu ms, %s", record->name,
+		 (unsigned long long)record->total_us / 1000, record->ret ? "failed" : "ok");
+	out(line);
+
+	for (i = 0; i < PERF_PHASES; i++) {
+		if (!record->us[i] && !record->bytes[i])
+			continue;
+		if (record->bytes[i] && record->us[i])
+			snprintf(line, sizeof(line), " %s: %llu ms, %llu KiB, %llu KiB/s", phase_names[i],
+				 (unsigned long long)record->us[i] / 1000,
+				 (unsigned long long)record->bytes[i] / 1024,
+				 (unsigned long long)(record->bytes[i] * 1000000 / 1024 / record->us[i]));
+		else
+			snprintf(line, sizeof(line), " %s: %llu ms", phase_names[i],
+				 (unsigned long long)record->us[i] / 1000);
+		out(line);
+	}
+}
+
+void perf_dump(void (*out) (const char *line))
+{
+	struct perf_record records[PERF_RING_SIZE];
+	unsigned int i, n;
+
+	n = perf_records(records, PERF_RING_SIZE);
+	for (i = 0; i < n; i++)
+		perf_report(&records[i], out);
+}
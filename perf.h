@@ -0,0 +1,53 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PERF_H_
+#define _PERF_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Where the time of a command goes. Phases may overlap: chunks are read
+ * and written by helper threads while the caller hashes. */
+enum perf_phase {
+	PERF_PROBE,		/* backend probing, partition lookup */
+	PERF_READ,		/* reading back from the device */
+	PERF_VERIFY,		/* hashing */
+	PERF_WRITE,		/* writing, erasing */
+	PERF_FSYNC,
+	PERF_PHASES
+};
+
+#define PERF_RING_SIZE	32
+#define PERF_NAME_LEN	32
+
+struct perf_record {
+	char name[PERF_NAME_LEN];
+	int ret;
+	uint64_t total_us;
+	uint64_t us[PERF_PHASES];
+	uint64_t bytes[PERF_PHASES];
+};
+
+uint64_t perf_now(void);
+void perf_begin(const char *name);
+bool perf_end(int ret);
+void perf_add(enum perf_phase phase, uint64_t start_us, uint64_t bytes);
+unsigned int perf_records(struct perf_record *records, unsigned int max);
+void perf_report(const struct perf_record *record, void (*out) (const char *line));
+void perf_dump(void (*out) (const char *line));
+
+#endif	/* _PERF_H_ */
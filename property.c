@@ -0,0 +1,151 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <cutils/properties.h>
+#define _REALLY_INCLUDE_SYS__SYSTEM_PROPERTIES_H_
+#include <sys/_system_properties.h>
+
+#include "property.h"
+#include "util.h"
+
+/* Without the watcher thread, properties are polled this often */
+#define PROPERTY_POLL_MS	10
+
+static pthread_mutex_t property_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t property_changed = PTHREAD_COND_INITIALIZER;
+static bool watching;
+
+/* __system_property_wait_any() cannot time out, so a thread sleeps in it
+ * for the life of the process and wakes every waiter on each change. */
+static void *property_watcher(void *arg)
+{
+	unsigned int serial = 0;
+
+	for (;;) {
+		serial = __system_property_wait_any(serial);
+		pthread_mutex_lock(&property_lock);
+		pthread_cond_broadcast(&property_changed);
+		pthread_mutex_unlock(&property_lock);
+	}
+	return NULL;
+}
+
+/* Called with property_lock held */
+static void start_watcher(void)
+{
+	static bool tried;
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	if (tried)
+		return;
+	tried = true;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	watching = !pthread_create(&thread, &attr, property_watcher, NULL);
+	pthread_attr_destroy(&attr);
+	if (!watching)
+		error("Can't start property watcher, polling instead\n");
+}
+
+static void add_ms(struct timespec *ts, unsigned int ms)
+{
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static bool before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/**
+ * Waits for any of the count properties of waits to hold its value,
+ * waking up as soon as a property changes.
+ *
+ * @return the index in waits of the first matching property
+ * @return -1 if none matched within timeout_ms
+ */
+int wait_properties(const struct property_wait *waits, unsigned int count,
+		    unsigned int timeout_ms)
+{
+	char value[PROPERTY_VALUE_MAX];
+	struct timespec deadline, wake;
+	bool expired = false;
+	unsigned int i;
+	int ret = -1;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	add_ms(&deadline, timeout_ms);
+
+	pthread_mutex_lock(&property_lock);
+	start_watcher();
+	for (;;) {
+		for (i = 0; i < count; i++) {
+			property_get(waits[i].name, value, "");
+			if (!strcmp(value, waits[i].value)) {
+				ret = i;
+				goto out;
+			}
+		}
+		if (expired)
+			break;
+
+		wake = deadline;
+		if (!watching) {
+			clock_gettime(CLOCK_REALTIME, &wake);
+			add_ms(&wake, PROPERTY_POLL_MS);
+			if (before(&deadline, &wake))
+				wake = deadline;
+		}
+		if (pthread_cond_timedwait(&property_changed, &property_lock, &wake) == ETIMEDOUT)
+			expired = !before(&wake, &deadline);
+	}
+out:
+	pthread_mutex_unlock(&property_lock);
+	return ret;
+}
+
+int wait_property(const char *name, const char *value, unsigned int timeout_ms)
+{
+	struct property_wait wait = { name, value };
+
+	return wait_properties(&wait, 1, timeout_ms) < 0 ? -1 : 0;
+}
+
+/* property_set() and wait for the new value to be visible */
+int property_set_wait(const char *name, const char *value, unsigned int timeout_ms)
+{
+	if (property_set(name, value)) {
+		error("Failed to set %s to %s\n", name, value);
+		return -1;
+	}
+	if (wait_property(name, value, timeout_ms)) {
+		error("%s did not become %s within %u ms\n", name, value, timeout_ms);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PROPERTY_H_
+#define _PROPERTY_H_
+
+/* A property and the value to wait for */
+struct property_wait {
+	const char *name;
+	const char *value;
+};
+
+int wait_properties(const struct property_wait *waits, unsigned int count,
+		    unsigned int timeout_ms);
+int wait_property(const char *name, const char *value, unsigned int timeout_ms);
+int property_set_wait(const char *name, const char *value, unsigned int timeout_ms);
+
+#endif	/* _PROPERTY_H_ */
@@ -22,13 +22,16 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <getopt.h>
 #include <unistd.h>
 #include <strings.h>
 
 #include "update_osip.h"
 #include "util.h"
+#include "flash_ops.h"
 #include "flash.h"
+#include "verify.h"
 
 #define UEFI_FW_IDX         0
 
@@ -275,11 +278,27 @@ void dump_OS_page(struct OSIP_header *osip, int os_index, int numpages)
 
 }
 
+/* Copy of the on-disk OSIP header, loaded by the first read_OSIP() and
+ * kept in sync by write_OSIP().  Anything writing to the start of
+ * MMC_DEV_POS behind our back must call flush_osip_cache(). */
+static struct OSIP_header osip_cache;
+static bool osip_cache_valid;
+
+void flush_osip_cache(void)
+{
+	osip_cache_valid = false;
+}
+
 int read_OSIP(struct OSIP_header *osip)
 {
 	int fd;
 	int ret = -1;
 
+	if (osip_cache_valid) {
+		memcpy(osip, &osip_cache, sizeof(*osip));
+		return 0;
+	}
+
 	memset((void *)osip, 0, sizeof(*osip));
 	fd = open(MMC_DEV_POS, O_RDONLY);
 	if (fd < 0) {
@@ -295,6 +314,8 @@ int read_OSIP(struct OSIP_header *osip)
 		fprintf(stderr, "OSIP is corrupt!");
 		goto out;
 	}
+	memcpy(&osip_cache, osip, sizeof(osip_cache));
+	osip_cache_valid = true;
 	ret = 0;
 out:
 	close(fd);
@@ -313,6 +334,9 @@ int write_OSIP(struct OSIP_header *osip)
 
 	sz = sizeof(*osip);
 
+	/* Whatever happens below, the disk no longer matches the cache */
+	flush_osip_cache();
+
 	fd = open(MMC_DEV_POS, O_RDWR);
 	if (fd < 0) {
 		fprintf(stderr, "write_OSIP: Can't open device %s: %s\n", MMC_DEV_POS, strerror(errno));
@@ -331,6 +355,9 @@ int write_OSIP(struct OSIP_header *osip)
 	}
 	fsync(fd);
 	close(fd);
+
+	memcpy(&osip_cache, osip, sizeof(osip_cache));
+	osip_cache_valid = true;
 	return 0;
 }
 
@@ -356,15 +383,51 @@ static int crack_stitched_image(void *data, struct OSII **rec, uint8_t ** blob)
 
 /* Pull the OS image data off the NAND into a .osupdate.bin for application of
  * a bsdiff patch */
+/* Build the one LBA OSIP header that precedes an OS image read back
+ * from eMMC, so the result can be flashed again as a stitched image. */
+static void build_osimage_header(const struct OSII *osii, unsigned char *page)
+{
+	struct OSIP_header file_osip;
+	struct OSII *file_osii;
+
+	/* Set up the fake OSIP header */
+	memset(&file_osip, 0, sizeof(file_osip));
+	file_osip.sig = OSIP_SIG;
+	file_osip.header_rev_minor = 0;
+	file_osip.header_rev_major = 0x1;
+	file_osip.num_pointers = 1;
+	file_osip.num_images = 1;
+	file_osip.header_size = (file_osip.num_pointers * 0x18) + 0x20;
+	file_osii = &file_osip.desc[0];
+	memcpy(file_osii, osii, sizeof(*osii));
+	file_osii->logical_start_block = 1;
+	if (file_osii->attribute != ATTR_SIGNED_FW && file_osii->attribute != ATTR_UNSIGNED_FW) {
+		/* The OS image might have been invalidated.
+		 * Restore the pointers */
+		file_osii->entry_point = ENTRY_POINT;
+		file_osii->ddr_load_address = DDR_LOAD_ADDX;
+	}
+
+	/* Create the checksum */
+	file_osip.header_checksum = 0;
+	file_osip.header_checksum = get_osip_crc(&file_osip);
+
+	/* The rest of block 0 is a long string of 0xFF, some empty
+	 * space, and the MBR magic cookie */
+	memset(page, 0, LBA_SIZE);
+	memcpy(page, &file_osip, 0x38);
+	memset(page + 0x38, 0xFF, 384);
+	page[LBA_SIZE - 2] = 0x55;
+	page[LBA_SIZE - 1] = 0xAA;
+}
+
 int read_osimage_data(void **data, size_t * size, int osii_index)
 {
 	struct OSIP_header osip;
-	struct OSIP_header file_osip;
-	struct OSII *osii, *file_osii;
+	struct OSII *osii;
 	unsigned char *blob;
 	size_t blob_size;
 	int fd;
-	size_t i;
 
 	if (read_OSIP(&osip)) {
 		fprintf(stderr, "read_OSIP fails\n");
@@ -385,44 +448,9 @@ int read_osimage_data(void **data, size_t * size, int osii_index)
 		return -1;
 	}
 
-	/* Set up the fake OSIP header and write it */
-	memset(&file_osip, 0, sizeof(file_osip));
-	file_osip.sig = OSIP_SIG;
-	file_osip.header_rev_minor = 0;
-	file_osip.header_rev_major = 0x1;
-	file_osip.num_pointers = 1;
-	file_osip.num_images = 1;
-	file_osip.header_size = (file_osip.num_pointers * 0x18) + 0x20;
-	file_osii = &file_osip.desc[0];
-	memcpy(file_osii, osii, sizeof(*osii));
-	file_osii->logical_start_block = 1;
-	if (file_osii->attribute != ATTR_SIGNED_FW && file_osii->attribute != ATTR_UNSIGNED_FW) {
-		/* The OS image might have been invalidated.
-		 * Restore the pointers */
-		file_osii->entry_point = ENTRY_POINT;
-		file_osii->ddr_load_address = DDR_LOAD_ADDX;
-	}
-
-	/* Create the checksum */
-	file_osip.header_checksum = 0;
-	file_osip.header_checksum = get_osip_crc(&file_osip);
-	memcpy(blob, &file_osip, sizeof(file_osip));
-
-	/* Write out the rest of block 0. There's a long string of 0xFF, some
-	 * empty space, and the MBR magic cookie */
-	blob += 0x38;
-	blob_size -= 0x38;
-	for (i = 0; i < 384; i++) {
-		*blob = 0xFF;
-		blob++;
-		blob_size--;
-	}
-	blob += 70;
-	blob_size -= 70;
-	blob[0] = 0x55;
-	blob[1] = 0xAA;
-	blob += 2;
-	blob_size -= 2;
+	build_osimage_header(osii, blob);
+	blob += LBA_SIZE;
+	blob_size -= LBA_SIZE;
 
 	fd = open(MMC_DEV_POS, O_RDONLY);
 	if (fd < 0) {
@@ -449,12 +477,78 @@ out_error:
 	return -1;
 }
 
+/* Same result as read_osimage_data(), but the image is a private mapping
+ * of the eMMC region instead of a heap copy: pages are faulted in as the
+ * caller walks the data and can be dropped again by the kernel.  The
+ * mapping starts early enough that the header LBA right before the image
+ * lands in the same mapping; writing the synthetic header there only
+ * copies that one page.  Release it with unmap_osimage_data(). */
+int map_osimage_data(void **data, size_t * size, int osii_index)
+{
+	struct OSIP_header osip;
+	struct OSII *osii;
+	off_t image_offset, map_offset;
+	size_t image_size, map_size;
+	long page_size;
+	unsigned char *base;
+	int fd;
+
+	if (read_OSIP(&osip)) {
+		fprintf(stderr, "read_OSIP fails\n");
+		return -1;
+	}
+
+	osii = &osip.desc[osii_index];
+	image_offset = (off_t)osii->logical_start_block * LBA_SIZE;
+	image_size = (size_t)osii->size_of_os_image * LBA_SIZE;
+	if (image_offset < LBA_SIZE) {
+		fprintf(stderr, "OSII %d has a bad start block\n", osii_index);
+		return -1;
+	}
+
+	page_size = sysconf(_SC_PAGESIZE);
+	map_offset = (image_offset - LBA_SIZE) & ~((off_t)page_size - 1);
+	map_size = image_offset + image_size - map_offset;
+
+	fd = open(MMC_DEV_POS, O_RDONLY);
+	if (fd < 0) {
+		pr_perror("open");
+		return -1;
+	}
+
+	base = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, map_offset);
+	close(fd);
+	if (base == MAP_FAILED) {
+		pr_perror("mmap");
+		return -1;
+	}
+	madvise(base, map_size, MADV_SEQUENTIAL);
+
+	*data = base + (image_offset - LBA_SIZE - map_offset);
+	*size = image_size + LBA_SIZE;
+	build_osimage_header(osii, *data);
+	return 0;
+}
+
+void unmap_osimage_data(void *data, size_t size)
+{
+	uintptr_t base;
+
+	if (!data)
+		return;
+
+	base = (uintptr_t)data & ~((uintptr_t)sysconf(_SC_PAGESIZE) - 1);
+	munmap((void *)base, size + ((uintptr_t)data - base));
+}
+
 #define OSIP_BACKUP_OFFSET 0xE0
 
 int destroy_the_osip_backup(void)
 {
 	int fd;
 	uint32_t sig;
+
+	flush_osip_cache();
 	fd = open(MMC_DEV_POS, O_RDWR);
 	if (fd < 0) {
 		fprintf(stderr, "destroy_the_osip_backup: can't open file %s: %s\n", MMC_DEV_POS, strerror(errno));
@@ -489,27 +583,18 @@ int write_stitch_image(void *data, size_t size, int osii_index)
 	return write_stitch_image_ex(data, size, osii_index, 0);
 }
 
-int write_stitch_image_ex(void *data, size_t size, int osii_index, int large_image)
+/* Pick the free slot the image described by osii goes to, and fill
+ * osip with the OSIP header to write once the image data is on disk. */
+static int prepare_stitch_image(struct OSIP_header *osip, struct OSII *osii,
+				size_t size, int osii_index, int large_image)
 {
-	struct OSIP_header osip;
-	struct OSII *osii;
-	uint8_t *blob;
 	unsigned max_size_lba;
-	int fd;
-
-	if (check_index_outofbound(osii_index))
-		return -1;
 
-	printf("Writing %zu byte image to osip[%d]\n", size, osii_index);
-	if (crack_stitched_image(data, &osii, &blob)) {
-		fprintf(stderr, "crack_stitched_image fails\n");
-		return -1;
-	}
 	if ((osii->size_of_os_image * LBA_SIZE) != size - LBA_SIZE) {
 		fprintf(stderr, "data format is not correct! \n");
 		return -1;
 	}
-	if (read_OSIP(&osip)) {
+	if (read_OSIP(osip)) {
 		fprintf(stderr, "read_OSIP fails\n");
 		return -1;
 	}
@@ -533,13 +618,13 @@ int write_stitch_image_ex(void *data, size_t size, int osii_index, int large_ima
 			osii->logical_start_block = OS_START_OFFSET;
 			max_size_lba = OS_MAX_LBA * OS_SLOTS;
 		} else {
-			osii->logical_start_block = get_free_os_lba(&osip);
+			osii->logical_start_block = get_free_os_lba(osip);
 			max_size_lba = OS_MAX_LBA;
 		}
 		break;
 	case ATTR_SIGNED_FW:
 	case ATTR_UNSIGNED_FW:
-		osii->logical_start_block = get_free_fw_lba(&osip);
+		osii->logical_start_block = get_free_fw_lba(osip);
 		max_size_lba = FW_MAX_LBA;
 		break;
 	default:
@@ -560,17 +645,17 @@ int write_stitch_image_ex(void *data, size_t size, int osii_index, int large_ima
 		fprintf(stderr, "unable to find free slot in emmc for osimage!\n");
 		return -1;
 	}
-	if (osii_index >= osip.num_pointers) {
-		osip.num_pointers = osii_index + 1;
-		osip.header_size = (osip.num_pointers * 0x18) + 0x20;
+	if (osii_index >= osip->num_pointers) {
+		osip->num_pointers = osii_index + 1;
+		osip->header_size = (osip->num_pointers * 0x18) + 0x20;
 	} else {
 		/* Preserve invalidation */
-		if (osip.desc[osii_index].ddr_load_address == 0 && osip.desc[osii_index].entry_point == 0) {
-			osii->ddr_load_address = osip.desc[osii_index].ddr_load_address;
-			osii->entry_point = osip.desc[osii_index].entry_point;
+		if (osip->desc[osii_index].ddr_load_address == 0 && osip->desc[osii_index].entry_point == 0) {
+			osii->ddr_load_address = osip->desc[osii_index].ddr_load_address;
+			osii->entry_point = osip->desc[osii_index].entry_point;
 		}
 	}
-	switch (osip.desc[osii_index].attribute & (~1)) {
+	switch (osip->desc[osii_index].attribute & (~1)) {
 	case ATTR_SIGNED_KERNEL:
 	case ATTR_SIGNED_POS:
 	case ATTR_SIGNED_COS:
@@ -579,51 +664,159 @@ int write_stitch_image_ex(void *data, size_t size, int osii_index, int large_ima
 	case ATTR_SIGNED_RAMDUMPOS:
 	case ATTR_UNSIGNED_KERNEL:
 	case ATTR_NOTUSED & (~1):
-		memcpy(&(osip.desc[osii_index]), osii, sizeof(struct OSII));
+		memcpy(&(osip->desc[osii_index]), osii, sizeof(struct OSII));
 		break;
 	default:
-		if ((osip.desc[osii_index].attribute & (~1)) == (osii->attribute & (~1))) {
+		if ((osip->desc[osii_index].attribute & (~1)) == (osii->attribute & (~1))) {
 			//if the attribute is the same, then overwrite it.
-			memcpy(&(osip.desc[osii_index]), osii, sizeof(struct OSII));
+			memcpy(&(osip->desc[osii_index]), osii, sizeof(struct OSII));
 		} else {
-			memcpy(&(osip.desc[osip.num_pointers]), &(osip.desc[osii_index]),
+			memcpy(&(osip->desc[osip->num_pointers]), &(osip->desc[osii_index]),
 			       sizeof(struct OSII));
-			memcpy(&(osip.desc[osii_index]), osii, sizeof(struct OSII));
-			osip.num_pointers++;
-			osip.header_size = (osip.num_pointers * 0x18) + 0x20;
+			memcpy(&(osip->desc[osii_index]), osii, sizeof(struct OSII));
+			osip->num_pointers++;
+			osip->header_size = (osip->num_pointers * 0x18) + 0x20;
 		}
 	}
 
+	return 0;
+}
+
+int write_stitch_image_ex(void *data, size_t size, int osii_index, int large_image)
+{
+	struct OSIP_header osip;
+	struct OSII *osii;
+	uint8_t *blob;
+
+	if (check_index_outofbound(osii_index))
+		return -1;
+
+	printf("Writing %zu byte image to osip[%d]\n", size, osii_index);
+	if (crack_stitched_image(data, &osii, &blob)) {
+		fprintf(stderr, "crack_stitched_image fails\n");
+		return -1;
+	}
+	if (prepare_stitch_image(&osip, osii, size, osii_index, large_image))
+		return -1;
+
 	/* Write the blob of data out to the disk */
-	fd = open(MMC_DEV_POS, O_RDWR);
-	if (fd < 0) {
-		fprintf(stderr, "fail open %s\n", MMC_DEV_POS);
+	if (verified_write(MMC_DEV_POS, (uint64_t)osii->logical_start_block * LBA_SIZE, blob, size - LBA_SIZE)) {
+		fprintf(stderr, "fail to write image to %s\n", MMC_DEV_POS);
 		return -1;
 	}
-	if (lseek(fd, osii->logical_start_block * LBA_SIZE, SEEK_SET) < 0) {
-		pr_perror("lseek");
-		close(fd);
+
+	/* New data is written out completely, OK to update the OSIP with
+	 * the new LBA values now */
+	return write_OSIP(&osip);
+}
+
+/* Streaming counterpart of flash_image_osip(): the stitched image is fed
+ * in pieces with osip_stream_write(), lands in a free slot as it arrives,
+ * and the OSIP only points at it once osip_stream_commit() has read the
+ * slot back and checked it, as write_stitch_image_ex() does. */
+int osip_stream_open(struct osip_stream *s, const char *name, size_t size)
+{
+	memset(s, 0, sizeof(*s));
+	s->name = name;
+	s->size = size;
+
+	if (size <= LBA_SIZE) {
+		fprintf(stderr, "osip_stream: image too small\n");
 		return -1;
 	}
 
-	size -= LBA_SIZE;
-	while (size) {
-		int ret = write(fd, blob, size);
-		if (ret <= 0 && errno != EINTR) {
-			pr_perror("write");
-			close(fd);
+	s->osii_index = get_named_osii_index(name, WRITE_OSIP_HEADER);
+	if (check_index_outofbound(s->osii_index))
+		return -1;
+
+	return 0;
+}
+
+static int osip_stream_start(struct osip_stream *s)
+{
+	struct OSII *osii;
+	uint8_t *blob;
+	int attr;
+
+	if (crack_stitched_image(s->header, &osii, &blob)) {
+		fprintf(stderr, "crack_stitched_image fails\n");
+		return -1;
+	}
+
+	/* Same attribute fixup as flash_image_osip() */
+	attr = get_named_osii_attr(s->name, NULL);
+	if (attr < 0)
+		return -1;
+	osii->attribute = attr + (osii->attribute & ATTR_UNSIGNED_KERNEL);
+
+	if (prepare_stitch_image(&s->osip, osii, s->size, s->osii_index, 0))
+		return -1;
+
+	s->vs = verified_stream_open(MMC_DEV_POS, (uint64_t)osii->logical_start_block * LBA_SIZE);
+	if (!s->vs) {
+		fprintf(stderr, "osip_stream: can't write to %s\n", MMC_DEV_POS);
+		return -1;
+	}
+	return 0;
+}
+
+int osip_stream_write(struct osip_stream *s, const void *data, size_t len)
+{
+	const unsigned char *what = data;
+	size_t n;
+
+	if (len > s->size - s->pos) {
+		fprintf(stderr, "osip_stream: image larger than %zu bytes\n", s->size);
+		return -1;
+	}
+
+	if (s->pos < LBA_SIZE) {
+		n = LBA_SIZE - s->pos;
+		if (n > len)
+			n = len;
+		memcpy(s->header + s->pos, what, n);
+		s->pos += n;
+		what += n;
+		len -= n;
+		if (s->pos == LBA_SIZE && osip_stream_start(s))
 			return -1;
-		}
-		blob += ret;
-		size -= ret;
 	}
 
-	fsync(fd);
-	close(fd);
+	if (!len)
+		return 0;
+	if (verified_stream_write(s->vs, what, len))
+		return -1;
+	s->pos += len;
+	return 0;
+}
+
+int osip_stream_commit(struct osip_stream *s)
+{
+	struct verified_stream *vs = s->vs;
+
+	if (s->pos != s->size) {
+		fprintf(stderr, "osip_stream: got %zu of %zu bytes\n", s->pos, s->size);
+		osip_stream_abort(s);
+		return -1;
+	}
+
+	/* Syncs the slot and checks its readback */
+	s->vs = NULL;
+	if (verified_stream_close(vs, false))
+		return -1;
 
 	/* New data is written out completely, OK to update the OSIP with
 	 * the new LBA values now */
-	return write_OSIP(&osip);
+	return write_OSIP(&s->osip);
+}
+
+/* Drop a stream without touching the OSIP: the slot written so far was
+ * free, so the current image stays in place. */
+void osip_stream_abort(struct osip_stream *s)
+{
+	if (s->vs)
+		verified_stream_close(s->vs, true);
+	s->vs = NULL;
 }
 
 int get_named_osii_attr(const char *destination, int *instance)
@@ -764,6 +957,7 @@ int oem_write_osip_header(int argc, char **argv)
 	restore_osii("boot");
 	restore_osii("recovery");
 	restore_osii("fastboot");
+	flash_ops_reset();
 	return 0;
 }
 
@@ -773,6 +967,7 @@ int oem_erase_osip_header(int argc, char **argv)
 	memset(&blank_osip, 0, sizeof(blank_osip));
 	fprintf(stderr, "Erase OSIP header\n");
 	write_OSIP(&blank_osip);
+	flash_ops_reset();
 	return 0;
 }
 
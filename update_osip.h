@@ -71,10 +71,13 @@ struct OSIP_header {		// os image profile
 uint8_t get_osip_crc(struct OSIP_header *osip);
 int write_OSIP(struct OSIP_header *osip);
 int read_OSIP(struct OSIP_header *osip);
+void flush_osip_cache(void);
 void dump_osip_header(struct OSIP_header *osip);
 void dump_OS_page(struct OSIP_header *osip, int os_index, int numpages);
 
 int read_osimage_data(void **data, size_t * size, int osii_index);
+int map_osimage_data(void **data, size_t * size, int osii_index);
+void unmap_osimage_data(void *data, size_t size);
 inline int check_index_outofbound(int osii_index);
 int write_stitch_image(void *data, size_t size, int osii_index);
 int write_stitch_image_ex(void *data, size_t size, int osii_index, int large_image);
@@ -108,4 +111,21 @@ int oem_erase_osip_header(int argc, char **argv);
 
 #define MMC_DEV_POS STORAGE_BASE_PATH
 
+struct verified_stream;
+
+struct osip_stream {
+	const char *name;
+	int osii_index;
+	size_t size;		/* stitched image size, header LBA included */
+	size_t pos;		/* bytes received so far */
+	unsigned char header[LBA_SIZE];
+	struct OSIP_header osip;	/* written out on commit */
+	struct verified_stream *vs;	/* the slot, once the header is in */
+};
+
+int osip_stream_open(struct osip_stream *s, const char *name, size_t size);
+int osip_stream_write(struct osip_stream *s, const void *data, size_t len);
+int osip_stream_commit(struct osip_stream *s);
+void osip_stream_abort(struct osip_stream *s);
+
 #endif
@@ -22,6 +22,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <sys/mman.h>
 
 #include <cutils/log.h>
 #include <mincrypt/sha.h>
@@ -30,6 +31,7 @@
 #include <bootimg.h>
 
 #include "flash.h"
+#include "flash_ops.h"
 #include "update_osip.h"
 #include "util.h"
 
@@ -79,7 +81,7 @@ static int check_recovery_image(const char *tgt_sha1, int *needs_patching)
 	}
 	printf("Good SHA1 digest passed in\n");
 
-	if ((sz = read_image(RECOVERY_OS_NAME, &data)) == -1) {
+	if ((sz = map_image(RECOVERY_OS_NAME, &data)) == -1) {
 		ALOGE("failed to read recovery image");
 		*needs_patching = 1;
 		return 0;
@@ -88,115 +90,155 @@ static int check_recovery_image(const char *tgt_sha1, int *needs_patching)
 	SHA_hash(data, sz, tgt_digest);
 
 	*needs_patching = memcmp(tgt_digest, expected_tgt_digest, SHA_DIGEST_SIZE);
-	free(data);
+	unmap_image(data, sz);
 	return 0;
 }
 
-typedef struct {
+/* On OSIP, the patched image goes straight to a free slot while
+ * ApplyImagePatch() hashes it, and the recovery OSII only switches over
+ * to the new slot once the digest is known to be right. Other backends
+ * have no spare slot: the image is buffered and flashed through
+ * flash_recovery_kernel() once checked. */
+struct recovery_sink {
+	bool osip;
+	struct osip_stream stream;
 	unsigned char *buffer;
-	ssize_t size;
-	ssize_t pos;
-} MemorySinkInfo;
+	size_t size;
+	size_t pos;
+};
 
-static ssize_t MemorySink(unsigned char *data, ssize_t len, void *token)
+static int recovery_sink_open(struct recovery_sink *sink, size_t size)
 {
-	MemorySinkInfo *msi = (MemorySinkInfo *) token;
-	if (msi->size - msi->pos < len) {
+	memset(sink, 0, sizeof(*sink));
+	sink->osip = !strcmp(flash_ops_backends()->bootimage, "osip");
+	if (sink->osip)
+		return osip_stream_open(&sink->stream, RECOVERY_OS_NAME, size);
+
+	sink->size = size;
+	sink->buffer = malloc(size);
+	if (!sink->buffer) {
+		LOGPERROR("malloc");
 		return -1;
 	}
-	memcpy(msi->buffer + msi->pos, data, len);
-	msi->pos += len;
+	return 0;
+}
+
+static ssize_t RecoverySink(unsigned char *data, ssize_t len, void *token)
+{
+	struct recovery_sink *sink = (struct recovery_sink *)token;
+
+	if (sink->osip)
+		return osip_stream_write(&sink->stream, data, len) ? -1 : len;
+
+	if (sink->size - sink->pos < (size_t)len)
+		return -1;
+	memcpy(sink->buffer + sink->pos, data, len);
+	sink->pos += len;
 	return len;
 }
 
+static void recovery_sink_abort(struct recovery_sink *sink)
+{
+	if (sink->osip)
+		osip_stream_abort(&sink->stream);
+	free(sink->buffer);
+	sink->buffer = NULL;
+}
+
+static int recovery_sink_commit(struct recovery_sink *sink)
+{
+	int ret = -1;
+
+	if (sink->osip)
+		return osip_stream_commit(&sink->stream);
+
+	if (sink->pos == sink->size)
+		ret = flash_recovery_kernel(sink->buffer, sink->size);
+	recovery_sink_abort(sink);
+	return ret;
+}
+
 static int patch_recovery(const char *src_sha1, const char *tgt_sha1,
 			  unsigned int tgt_size, const char *patchfile)
 {
-	MemorySinkInfo msi;
+	struct recovery_sink sink;
 	void *src_data;
-	void *recovery_data;
 	int src_size;
-	int recovery_size;
+	int patch_size;
 	uint8_t expected_src_digest[SHA_DIGEST_SIZE];
 	uint8_t src_digest[SHA_DIGEST_SIZE];
 	uint8_t expected_tgt_digest[SHA_DIGEST_SIZE];
-	uint8_t tgt_digest[SHA_DIGEST_SIZE];
 	SHA_CTX ctx;
-
 	Value patchval;
-
-	msi.buffer = NULL;
-	src_data = NULL;
-	patchval.data = NULL;
-	SHA_init(&ctx);
+	int ret = -1;
 
 	if (ParseSha1(src_sha1, expected_src_digest)) {
 		ALOGE("Bad SHA1 src SHA1 digest %s passed in", src_sha1);
 		return -1;
 	}
-        printf("src_sha1 : %s\n",src_sha1);
-        printf("expected_digest_src_sha1 : %x\n",expected_src_digest);
 
 	if (ParseSha1(tgt_sha1, expected_tgt_digest)) {
 		ALOGE("Bad SHA1 tgt SHA1 digest %s passed in", tgt_sha1);
 		return -1;
 	}
 
-	src_size = read_image(ANDROID_OS_NAME, &src_data);
-	recovery_size = read_image(RECOVERY_OS_NAME, &recovery_data);
-        printf("read size : %d\n",src_size);
+	if (tgt_size > TGT_SIZE_MAX) {
+		ALOGE("tgt_size is too big!");
+		return -1;
+	}
+
+	src_size = map_image(ANDROID_OS_NAME, &src_data);
 	if (src_size == -1) {
 		ALOGE("Failed to read image %s\n", ANDROID_OS_NAME);
 		return -1;
 	}
 
 	SHA_hash(src_data, src_size, src_digest);
-        printf("digests : %x vs %x\n",src_digest,expected_src_digest);
 	if (memcmp(src_digest, expected_src_digest, SHA_DIGEST_SIZE)) {
 		ALOGE("boot image digests don't match!");
-		goto out;
-	}
-
-	msi.pos = 0;
-	if (tgt_size > TGT_SIZE_MAX) {
-		ALOGE("tgt_size is too big!");
-		goto out;
-	}
-	msi.size = tgt_size;
-	msi.buffer = malloc(tgt_size);
-	if (!msi.buffer) {
-		LOGPERROR("malloc");
-		goto out;
+		goto unmap_src;
 	}
 
-	if (file_read(patchfile, (void **)&patchval.data, (size_t *) & patchval.size)) {
+	patch_size = file_size(patchfile);
+	if (patch_size == -1)
+		goto unmap_src;
+	patchval.data = file_mmap(patchfile, patch_size, false);
+	if (!patchval.data || patchval.data == MAP_FAILED) {
 		ALOGE("Coudln't read patch data");
-		goto out;
+		goto unmap_src;
 	}
+	patchval.size = patch_size;
 	patchval.type = VAL_BLOB;
 
-        printf("before applyimagepatch\n");
-	if (ApplyImagePatch(src_data, src_size, &patchval, MemorySink, &msi, &ctx, NULL)) {
+	if (recovery_sink_open(&sink, tgt_size)) {
+		ALOGE("Can't start writing recovery image");
+		recovery_sink_abort(&sink);
+		goto unmap_patch;
+	}
+
+	SHA_init(&ctx);
+	if (ApplyImagePatch(src_data, src_size, &patchval, RecoverySink, &sink, &ctx, NULL)) {
 		ALOGE("Patching process failed");
-		goto out;
+		recovery_sink_abort(&sink);
+		goto unmap_patch;
 	}
-        printf("after applyimagepatch\n");
-	SHA_hash(msi.buffer, msi.size, tgt_digest);
-	if (memcmp(tgt_digest, expected_tgt_digest, SHA_DIGEST_SIZE)) {
-		ALOGE("output recovery image digest mismatch %s vs %s",tgt_digest,expected_tgt_digest);
-		goto out;
+	if (memcmp(SHA_final(&ctx), expected_tgt_digest, SHA_DIGEST_SIZE)) {
+		ALOGE("output recovery image digest mismatch");
+		recovery_sink_abort(&sink);
+		goto unmap_patch;
 	}
-	if (flash_recovery_kernel(msi.buffer, msi.size)) {
+	if (recovery_sink_commit(&sink)) {
 		ALOGE("error writing patched recovery image");
-		goto out;
+		goto unmap_patch;
 	}
 	ALOGI("Recovery sucessfully patched from boot");
+	ret = 0;
 
-out:
-	free(src_data);
-	free(patchval.data);
-	free(msi.buffer);
-	return 0;
+unmap_patch:
+	munmap(patchval.data, patch_size);
+unmap_src:
+	unmap_image(src_data, src_size);
+	return ret;
 }
 
 static void usage(void)
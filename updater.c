@@ -35,8 +35,15 @@
 #include "tee_connector.h"
 #endif
 #include "oem_partition.h"
+#include "partition_plan.h"
 
 #include "flash.h"
+#include "verify.h"
+#include "perf.h"
+#include "property.h"
+
+/* How long the property service may take to publish sys.partitioning */
+#define PARTITIONING_HANDSHAKE_MS	5000
 
 Value *ExtractImageFn(const char *name, State * state, int argc, Expr * argv[])
 {
@@ -133,6 +140,46 @@ enum flash_option_type {
 #define BOM_TOKEN_NAME "bom-token"
 #endif
 
+#define ZIP_STORED 0
+
+static bool zip_entry_is_mapped(const ZipArchive * za, const ZipEntry * entry)
+{
+	return entry->compression == ZIP_STORED &&
+	    entry->offset >= 0 && (size_t)entry->offset + entry->uncompLen <= za->length;
+}
+
+/* Return the uncompressed content of 'entry'. Stored entries point
+ * straight into the archive mapping, others are inflated into a buffer
+ * returned in *to_free that the caller must release. */
+static unsigned char *zip_entry_data(ZipArchive * za, const ZipEntry * entry, unsigned char **to_free)
+{
+	unsigned char *buffer;
+
+	*to_free = NULL;
+	if (!mzGetZipEntryUncompLen(entry)) {
+		error("%.*s is empty\n", entry->fileNameLen, entry->fileName);
+		return NULL;
+	}
+
+	if (zip_entry_is_mapped(za, entry))
+		return za->addr + entry->offset;
+
+	buffer = malloc(mzGetZipEntryUncompLen(entry));
+	if (!buffer) {
+		error("Unable to alloc ifwi buffer of %ld bytes.\n", mzGetZipEntryUncompLen(entry));
+		return NULL;
+	}
+
+	if (!mzExtractZipEntryToBuffer(za, entry, buffer)) {
+		error("Failed to unzip %.*s\n", entry->fileNameLen, entry->fileName);
+		free(buffer);
+		return NULL;
+	}
+
+	*to_free = buffer;
+	return buffer;
+}
+
 Value *FlashIfwiOrBomFn(enum flash_option_type flash_option, const char *name, State * state, int argc,
 			Expr * argv[])
 {
@@ -143,8 +190,9 @@ Value *FlashIfwiOrBomFn(enum flash_option_type flash_option, const char *name, S
 	ZipArchive ifwi_za;
 	const ZipEntry *ifwi_entry;
 	unsigned char *buffer;
+	unsigned char *to_free;
 	unsigned char *file_buf = NULL;
-	size_t file_size;
+	int file_len = -1;
 #ifdef TEE_FRAMEWORK
 	char bom_token_name[128];
 	const ZipEntry *bom_token_entry;
@@ -161,13 +209,22 @@ Value *FlashIfwiOrBomFn(enum flash_option_type flash_option, const char *name, S
 		goto done;
 	}
 
-	err = file_read(filename, (void **)&file_buf, &file_size);
-	if (err) {
+	/* Map the archive rather than reading it: only the IFWI entries
+	 * get paged in, or inflated when compressed. */
+	file_len = file_size(filename);
+	if (file_len == -1) {
 		ErrorAbort(state, "Failed to open zip archive file %s\n", filename);
 		goto done;
 	}
 
-	err = mzOpenZipArchive(file_buf, file_size, &ifwi_za);
+	file_buf = file_mmap(filename, file_len, false);
+	if (file_buf == NULL || file_buf == MAP_FAILED) {
+		file_buf = NULL;
+		ErrorAbort(state, "Failed to open zip archive file %s\n", filename);
+		goto done;
+	}
+
+	err = mzOpenZipArchive(file_buf, file_len, &ifwi_za);
 	if (err) {
 		ErrorAbort(state, "Failed to open zip archive\n");
 		goto done;
@@ -190,20 +247,17 @@ Value *FlashIfwiOrBomFn(enum flash_option_type flash_option, const char *name, S
 			ErrorAbort(state, "Bad ifwi_entry size : %d.\n", buffsize);
 			goto error;
 		}
-		buffer = (unsigned char *)malloc(sizeof(unsigned char) * buffsize);
+
+		/* Every FIP of the IFWI counts in its version, so compressed
+		 * entries are inflated whole before being checked */
+		buffer = zip_entry_data(&ifwi_za, ifwi_entry, &to_free);
 		if (buffer == NULL) {
-			ErrorAbort(state, "Unable to alloc ifwi buffer of %d bytes.\n", buffsize);
-			goto error;
-		}
-		err = mzExtractZipEntryToBuffer(&ifwi_za, ifwi_entry, buffer);
-		if (!err) {
-			ErrorAbort(state, "Failed to unzip %s\n", IFWI_BIN_PATH);
-			free(buffer);
+			ErrorAbort(state, "Failed to extract %s\n", ifwi_name);
 			goto error;
 		}
 
 		if (check_ifwi_file(buffer, buffsize) < 1) {
-			free(buffer);
+			free(to_free);
 			continue;
 		}
 
@@ -219,7 +273,7 @@ Value *FlashIfwiOrBomFn(enum flash_option_type flash_option, const char *name, S
 				if (bom_token_buffsize <= 0) {
 					ErrorAbort(state, "Bad bom_token_entry size : %d.\n",
 						   bom_token_buffsize);
-					free(buffer);
+					free(to_free);
 					goto error;
 				}
 				bom_token_buffer =
@@ -227,14 +281,14 @@ Value *FlashIfwiOrBomFn(enum flash_option_type flash_option, const char *name, S
 				if (bom_token_buffer == NULL) {
 					ErrorAbort(state, "Unable to alloc bom token buffer of %d bytes.\n",
 						   bom_token_buffsize);
-					free(buffer);
+					free(to_free);
 					goto error;
 				}
 				err = mzExtractZipEntryToBuffer(&ifwi_za, bom_token_entry, bom_token_buffer);
 				if (!err) {
 					ErrorAbort(state, "Failed to unzip %s.\n", IFWI_BIN_PATH);
 					free(bom_token_buffer);
-					free(buffer);
+					free(to_free);
 					goto error;
 				}
 				start_update(0, NULL);
@@ -245,7 +299,7 @@ Value *FlashIfwiOrBomFn(enum flash_option_type flash_option, const char *name, S
 					printf("Unable to write BOM token.\n");
 					cancel_update(0, NULL);
 					free(bom_token_buffer);
-					free(buffer);
+					free(to_free);
 					ret = StringValue(strdup(""));
 					goto error;
 				}
@@ -259,10 +313,10 @@ Value *FlashIfwiOrBomFn(enum flash_option_type flash_option, const char *name, S
 			update_ifwi_file(buffer, buffsize);
 		} else {
 			ErrorAbort(state, "Don't know what to do with option %d\n", flash_option);
-			free(buffer);
+			free(to_free);
 			goto error;
 		}
-		free(buffer);
+		free(to_free);
 	}
 
 	ret = StringValue(strdup("t"));
@@ -271,7 +325,8 @@ error:
 	mzCloseZipArchive(&ifwi_za);
 
 done:
-	free(file_buf);
+	if (file_buf)
+		munmap(file_buf, file_len);
 	if (filename)
 		free(filename);
 
@@ -627,8 +682,6 @@ Value *FlashImageAtOffset(const char *name, State * state, int argc, Expr * argv
 	char *filename, *offset_str;
 	void *data;
 	off_t offset;
-	int fd;
-	int ret;
 
 	if (argc != 2) {
 		ErrorAbort(state, "%s: Invalid parameters.", name);
@@ -656,41 +709,16 @@ Value *FlashImageAtOffset(const char *name, State * state, int argc, Expr * argv
 		goto free;
 	}
 
-	fd = open(MMC_DEV_POS, O_WRONLY);
-	if (fd == -1) {
-		ErrorAbort(state, "%s: Failed to open %s device block, %s.",
-			   name, MMC_DEV_POS, strerror(errno));
-		goto unmmap_file;
-	}
-
-	ret = lseek(fd, offset, SEEK_SET);
-	if (ret == -1) {
-		ErrorAbort(state, "%s: Failed to seek into %s device block, %s.",
-			   name, MMC_DEV_POS, strerror(errno));
-		goto close;
-	}
-
-	char *ptr = (char *)data;
-	ret = 0;
-	for (; length; length -= ret, ptr += ret) {
-		ret = write(fd, ptr, length);
-		if (ret == -1) {
-			ErrorAbort(state, "%s: Failed to write into %s device block, %s.",
-				   name, MMC_DEV_POS, strerror(errno));
-			goto close;
-		}
-	}
+	if (offset < (off_t)sizeof(struct OSIP_header))
+		flush_osip_cache();
 
-	ret = fsync(fd);
-	if (ret == -1) {
-		ErrorAbort(state, "%s: Failed to sync %s, %s.", name, MMC_DEV_POS, strerror(errno));
-		goto close;
+	if (verified_write(MMC_DEV_POS, offset, data, length)) {
+		ErrorAbort(state, "%s: Failed to write into %s device block.", name, MMC_DEV_POS);
+		goto unmmap_file;
 	}
 
 	funret = StringValue(strdup("t"));
 
-close:
-	close(fd);
 unmmap_file:
 	munmap(data, length);
 free:
@@ -715,27 +743,26 @@ Value *FlashPartition(const char *name, State * state, int argc, Expr * argv[])
 	 * are still mounted, reload would failed.  */
 	oem_partition_disable_cmd_reload();
 
-	property_set("sys.partitioning", "1");
+	if (property_set_wait("sys.partitioning", "1", PARTITIONING_HANDSHAKE_MS)) {
+		ErrorAbort(state, "%s: can't start partitioning", name);
+		return NULL;
+	}
 	ret = CommandFunction(oem_partition_cmd_handler, name, state, argc, argv);
-	property_set("sys.partitioning", "0");
+	property_set_wait("sys.partitioning", "0", PARTITIONING_HANDSHAKE_MS);
 
 	return ret;
 }
 
-#define PARTITION_UPDATE "/tmp/partition_update.tbl"
-
 Value *FlashOsipToGPTPartition(const char *name, State * state, int argc, Expr * argv[])
 {
-	FILE *fp, *fp_update;
+	struct partition_plan *plan;
+	struct plan_entry *e;
 	char *filename;
-	char buffer[K_MAX_ARG_LEN];
-	char partition_type[K_MAX_ARG_LEN];
-	char **gpt_argv = NULL;
-	unsigned int j;
-	int i, gpt_argc = 0;
+	unsigned int i, j;
+	int64_t osii_lba;
 	Value *ret = NULL;
 	struct OSIP_header osip;
-
+	const char *update_partitions[] = { ANDROID_OS_NAME, RECOVERY_OS_NAME, FASTBOOT_OS_NAME };
 
 	/* Do not reload partition table during OTA since some partition
 	 * are still mounted, reload would failed.  */
@@ -756,144 +783,74 @@ Value *FlashOsipToGPTPartition(const char *name, State * state, int argc, Expr *
 	}
 	dump_osip_header(&osip);
 
-	/* Open partition and partition update files */
-	fp = fopen(filename, "r");
-	if (!fp) {
-		ErrorAbort(state, "%s: Can't open %s partition file.", name, filename);
-		free(filename);
-		ret = StringValue(strdup(""));
-		goto exit;
-	}
-	fp_update = fopen(PARTITION_UPDATE, "w+");
-	if (!fp_update) {
-		ErrorAbort(state, "%s: Can't create %s partition file\n", name, PARTITION_UPDATE);
-		fclose(fp);
-		free(filename);
-		ret = StringValue(strdup(""));
-		goto exit;
-	}
-
-	/* Check first line of partition file */
-	memset(buffer, 0, sizeof(buffer));
-	if (!fgets(buffer, sizeof(buffer), fp)) {
-		ErrorAbort(state, "partition file is empty");
-		ret = StringValue(strdup(""));
-		goto error;
-	}
-	buffer[strlen(buffer) - 1] = '\0';
-	if (sscanf(buffer, "%*[^=]=%255s", partition_type) != 1) {
-		ErrorAbort(state, "partition file is invalid");
-		ret = StringValue(strdup(""));
-		goto error;
+	plan = partition_plan_load(filename);
+	free(filename);
+	if (!plan) {
+		ErrorAbort(state, "%s: partition file is invalid", name);
+		return StringValue(strdup(""));
 	}
 
-	/* Write first line in update file */
-	fprintf(fp_update, "%s\n", buffer);
+	/* "reserved" partitions are not added back, and the OS partitions
+	 * are placed over the OSII that currently hold the OS images */
+	for (i = 0; i < plan->count; ) {
+		e = &plan->entries[i];
+		if (e->command != PLAN_ADD) {
+			i++;
+			continue;
+		}
 
-	/* parse partitition files line to catch update_partitions */
-	while (fgets(buffer, sizeof(buffer), fp)) {
-		if (buffer[strlen(buffer) - 1] == '\n')
-			buffer[strlen(buffer) - 1] = '\0';
-		gpt_argv = str_to_array(buffer, &gpt_argc);
-		if (gpt_argv == NULL)
+		if (((e->flags & PLAN_SET_TYPE) && GuidEqual(&e->type_guid, &guid_chromeos_reserved)) ||
+		    !strcmp(e->label, "reserved")) {
+			partition_plan_remove(plan, e);
 			continue;
-		char *command = gpt_argv[0];
-		uint64_t  size, lba_start;
-		int64_t osii_lba;
-		bool update_need =  false;
-		bool update_write = true;
-		char *e;
-		const char* update_partitions[] = {ANDROID_OS_NAME, RECOVERY_OS_NAME, FASTBOOT_OS_NAME};
-
-		/* catch add commands */
-		if (0 == strncmp("add", command, strlen(command))) {
-			/* catch partitions to update */
-			for (i = 0; i < gpt_argc; i++) {
-				/* Do not write back "reserved" */
-				if (0 == strncmp("reserved", gpt_argv[i], strlen(gpt_argv[i])))
-					update_write = false;
-				for (j = 0; j < ARRAY_SIZE(update_partitions); j++) {
-					if (0 == strncmp(update_partitions[j], gpt_argv[i], strlen(gpt_argv[i]))) {
-						if ((osii_lba = get_named_osii_logical_start_block(gpt_argv[i])) == -1) {
-							ErrorAbort(state, "Unable to get LBA of %s partition", gpt_argv[i]);
-							ret = StringValue(strdup(""));
-							goto error;
-						}
-						printf("Found %s partition at osii_lba %"PRId64"\n", gpt_argv[i], osii_lba);
-						update_need = true;
-						break;
-					}
-				}
-				if (update_need || !update_write)
-					break;
-			}
+		}
 
-			/* update size and LBA */
-			if (update_need) {
-				for (i = 0; i < gpt_argc; i++) {
-					if (0 == strncmp("-s", gpt_argv[i], strlen(gpt_argv[i]))) {
-						size = strtoull(gpt_argv[i+1], &e, 0);
-						if (e && *e) {
-							ErrorAbort(state, "Unable to get size of partition %s", buffer);
-							ret = StringValue(strdup(""));
-							goto error;
-						}
-						printf("Size was %"PRIu64" new is %u \n", size, OS_MAX_LBA);
-						sprintf(gpt_argv[i+1],"%d", OS_MAX_LBA);
-					}
-					if (0 == strncmp("-b", gpt_argv[i], strlen(gpt_argv[i]))) {
-						lba_start = strtoull(gpt_argv[i+1], &e, 0);
-						if (e && *e) {
-							ErrorAbort(state, "Unable to get LBA of partition %s", buffer);
-							ret = StringValue(strdup(""));
-							goto error;
-						}
-						printf("LBA was %"PRIu64" new is %"PRId64" \n", lba_start, osii_lba);
-						sprintf(gpt_argv[i+1],"%"PRId64"", osii_lba);
-					}
-				}
+		for (j = 0; j < ARRAY_SIZE(update_partitions); j++) {
+			if (!(e->flags & PLAN_SET_LABEL) || strcmp(update_partitions[j], e->label))
+				continue;
+
+			if ((osii_lba = get_named_osii_logical_start_block(e->label)) == -1) {
+				ErrorAbort(state, "Unable to get LBA of %s partition", e->label);
+				ret = StringValue(strdup(""));
+				goto free;
 			}
-		}
+			printf("Found %s partition at osii_lba %"PRId64"\n", e->label, osii_lba);
 
-		/* write lines in partition update */
-		for (i = 0; i < gpt_argc; i++) {
-			if (update_write)
-				fprintf(fp_update,"%s ",gpt_argv[i]);
-			free(gpt_argv[i]);
-			gpt_argv[i] = NULL;
+			if (e->flags & PLAN_SET_SIZE) {
+				printf("Size was %"PRIu64" new is %u \n", e->size, OS_MAX_LBA);
+				e->size = OS_MAX_LBA;
+				e->flags &= ~PLAN_SIZE_UNITS;
+			}
+			if (e->flags & (PLAN_SET_BEGIN | PLAN_BEGIN_AUTO)) {
+				printf("LBA was %"PRIu64" new is %"PRId64" \n", e->begin, osii_lba);
+				e->begin = osii_lba;
+				e->flags &= ~PLAN_BEGIN_AUTO;
+				e->flags |= PLAN_SET_BEGIN;
+			}
+			/* OSIP gives the exact LBAs, they must not move */
+			e->flags &= ~PLAN_ALIGN;
+			break;
 		}
-		if (update_write)
-			fprintf(fp_update,"\n");
-		free(gpt_argv);
-		gpt_argv = NULL;
+		i++;
 	}
 
-	/* Ensure to close fp_update as it will be re-open by oem_partition_cmd_handler */
-	free(filename);
-	fclose(fp);
-	fclose(fp_update);
-
-	/* partition with new partition file */
-	property_set("sys.partitioning", "1");
-
-	char *path[] = {0,PARTITION_UPDATE};
-	int partret = -1;
+	/* partition with the updated plan */
+	if (property_set_wait("sys.partitioning", "1", PARTITIONING_HANDSHAKE_MS)) {
+		ErrorAbort(state, "%s: can't start partitioning", name);
+		ret = StringValue(strdup(""));
+		goto free;
+	}
 
-	if ((partret = oem_partition_cmd_handler(2,(char **)path)) == -1) {
-		ErrorAbort(state, "%s: re-partitionning fails with error %d", name, partret);
+	if (oem_partition_apply_plan(plan, false)) {
+		ErrorAbort(state, "%s: re-partitionning fails", name);
 		ret = StringValue(strdup(""));
 	}
 	else
 		ret = StringValue(strdup("t"));
-	property_set("sys.partitioning", "0");
+	property_set_wait("sys.partitioning", "0", PARTITIONING_HANDSHAKE_MS);
 
-	goto exit;
-
-error:
-	free(filename);
-	fclose(fp);
-	fclose(fp_update);
-exit:
+free:
+	free(plan);
 	return ret;
 }
 
@@ -902,16 +859,12 @@ Value *FlashImageAtPartition(const char *name, State * state, int argc, Expr * a
 {
 	Value *funret = NULL;
 	char *osname, *filename, *parttable;
+	struct partition_plan *plan;
+	struct plan_entry *e;
+	bool found;
 	void *data;
 	off_t offset = 0;
-	int fd;
-	FILE *fp;
-	char buffer[K_MAX_ARG_LEN];
-	char partition_type[K_MAX_ARG_LEN];
-	char **gpt_argv = NULL;
-	int i, gpt_argc = 0;
 	Value *ret = NULL;
-	int fret;
 
 	if (argc != 3) {
 		ErrorAbort(state, "%s: Invalid parameters.", name);
@@ -923,76 +876,21 @@ Value *FlashImageAtPartition(const char *name, State * state, int argc, Expr * a
 		goto exit;
 	}
 
-	/* Open partition file */
-	fp = fopen(parttable, "r");
-	if (!fp) {
-		ErrorAbort(state, "%s: Can't open %s partition file.", name, parttable);
+	plan = partition_plan_load(parttable);
+	if (!plan) {
+		ErrorAbort(state, "%s: Can't load %s partition file.", name, parttable);
 		ret = StringValue(strdup(""));
 		goto free;
 	}
 
-	/* Check first line of partition file */
-	memset(buffer, 0, sizeof(buffer));
-	if (!fgets(buffer, sizeof(buffer), fp)) {
-		ErrorAbort(state, "partition file is empty");
-		ret = StringValue(strdup(""));
-		goto free;
-	}
-	buffer[strlen(buffer) - 1] = '\0';
-	if (sscanf(buffer, "%*[^=]=%255s", partition_type) != 1) {
-		ErrorAbort(state, "partition file is invalid");
-		ret = StringValue(strdup(""));
-		goto free;
-	}
-
-	bool found = false;
-	/* parse partitition files line to catch osname */
-	while (fgets(buffer, sizeof(buffer), fp)) {
-		if (buffer[strlen(buffer) - 1] == '\n')
-			buffer[strlen(buffer) - 1] = '\0';
-		gpt_argv = str_to_array(buffer, &gpt_argc);
-		if (gpt_argv == NULL)
-			continue;
-		char *command = gpt_argv[0];
-		char* e;
-		/* catch add commands */
-		if (0 == strncmp("add", command, strlen(command))) {
-			/* catch partitions to update */
-			for (i=0; i < gpt_argc; i++) {
-				if (0 == strncmp(osname, gpt_argv[i], strlen(gpt_argv[i]))) {
-					found = true;
-					printf("found %s ", osname);
-				}
-			}
-			/* get offset of osname */
-			if (found) {
-				for (i=0; i < gpt_argc; i++) {
-					if (0 == strncmp("-b", gpt_argv[i], strlen(gpt_argv[i]))) {
-						offset = strtoull(gpt_argv[i+1], &e, 0) * 512;
-						if (e && *e) {
-							ErrorAbort(state, "Unable to get LBA of partition %s", buffer);
-							ret = StringValue(strdup(""));
-							goto free;
-						}
-						printf("at LBA %s offset % ld \n", gpt_argv[i+1], offset);
-					}
-				}
-			}
-		}
-		/* free gpt_argv */
-		for (i = 0; i < gpt_argc; i++) {
-			free(gpt_argv[i]);
-			gpt_argv[i] = NULL;
-		}
-		free(gpt_argv);
-		gpt_argv = NULL;
-		if (found)
-			break;
-	}
-	fclose(fp);
+	e = partition_plan_find(plan, osname);
+	found = e && (e->flags & PLAN_SET_BEGIN);
+	if (found)
+		offset = e->begin * 512;
+	free(plan);
 
 	if (!found) {
-		ErrorAbort(state, "partition %s not found in %s", name, parttable);
+		ErrorAbort(state, "partition %s not found in %s", osname, parttable);
 		ret = StringValue(strdup(""));
 		goto free;
 	} else {
@@ -1009,44 +907,14 @@ Value *FlashImageAtPartition(const char *name, State * state, int argc, Expr * a
 		goto free;
 	}
 
-	fd = open(MMC_DEV_POS, O_WRONLY);
-	if (fd == -1) {
-		ErrorAbort(state, "%s: Failed to open %s device block, %s.",
-			   name, MMC_DEV_POS, strerror(errno));
-		goto unmmap_file;
-	}
-
-	fret = lseek(fd, offset, SEEK_SET);
-	if (fret == -1) {
-		ErrorAbort(state, "%s: Failed to seek into %s device block, %s.",
-			   name, MMC_DEV_POS, strerror(errno));
+	if (verified_write(MMC_DEV_POS, offset, data, length)) {
+		ErrorAbort(state, "%s: Failed to write into %s device block.", name, MMC_DEV_POS);
 		ret = StringValue(strdup(""));
-		goto close;
-	}
-
-	char *ptr = (char *)data;
-	fret = 0;
-	for (; length; length -= fret, ptr += fret) {
-		fret = write(fd, ptr, length);
-		if (fret == -1) {
-			ErrorAbort(state, "%s: Failed to write into %s device block, %s.",
-				   name, MMC_DEV_POS, strerror(errno));
-			ret = StringValue(strdup(""));
-			goto close;
-		}
-	}
-
-	fret = fsync(fd);
-	if (fret == -1) {
-		ErrorAbort(state, "%s: Failed to sync %s, %s.", name, MMC_DEV_POS, strerror(errno));
-		ret = StringValue(strdup(""));
-		goto close;
+		goto unmmap_file;
 	}
 
 	ret = StringValue(strdup("t"));
 
-close:
-	close(fd);
 unmmap_file:
 	munmap(data, length);
 free:
@@ -1058,6 +926,45 @@ exit:
 }
 
 
+Value *SmartFlashFn(const char *name, State * state, int argc, Expr * argv[])
+{
+	return CommandFunction(oem_smart_flash, name, state, argc, argv);
+}
+
+/* verify_image(name, sha1) returns "t" if the flashed image name has the
+ * given SHA1, "" otherwise, so that scripts can assert() on it without
+ * pulling the image back to the host. */
+Value *VerifyImageFn(const char *name, State * state, int argc, Expr * argv[])
+{
+	Value *ret = NULL;
+	char *image = NULL;
+	char *sha1 = NULL;
+	uint8_t digest[SHA_DIGEST_SIZE];
+
+	if (argc != 2) {
+		ErrorAbort(state, "%s: Invalid parameters.", name);
+		goto exit;
+	}
+
+	if (ReadArgs(state, argv, 2, &image, &sha1) < 0) {
+		ErrorAbort(state, "%s: ReadArgs failed.", name);
+		goto exit;
+	}
+
+	if (parse_sha1(sha1, digest)) {
+		ErrorAbort(state, "%s: bad SHA1 digest %s.", name, sha1);
+		goto free;
+	}
+
+	ret = StringValue(strdup(verify_image(image, digest) ? "" : "t"));
+
+free:
+	free(image);
+	free(sha1);
+exit:
+	return ret;
+}
+
 Value *EraseOsipHeader(const char *name, State * state, int argc, Expr * argv[])
 {
 	Value *ret = NULL;
@@ -1066,9 +973,64 @@ Value *EraseOsipHeader(const char *name, State * state, int argc, Expr * argv[])
 	return ret;
 }
 
+/* Flash, erase and partitioning functions go through TimedFn, which
+ * records them in the perf ring and logs where their time went. */
+static const struct {
+	const char *name;
+	Function fn;
+} timed_functions[] = {
+	{ "flash_ifwi", FlashIfwiFn },
+	{ "flash_capsule", FlashCapsuleFn },
+	{ "flash_esp_update", FlashEspUpdateFn },
+	{ "flash_ulpmc", FlashUlpmcFn },
+	{ "flash_partition", FlashPartition },
+	{ "flash_osiptogpt_partition", FlashOsipToGPTPartition },
+	{ "flash_image_at_partition", FlashImageAtPartition },
+	{ "flash_image_at_offset", FlashImageAtOffset },
+	{ "flash_os_image", FlashOSImage },
+	{ "write_osip_image", FlashOSImage },
+	{ "erase_osip", EraseOsipHeader },
+	{ "verify_image", VerifyImageFn },
+};
+
+static void perf_log(const char *line)
+{
+	printf("perf: %s\n", line);
+}
+
+/* Edify functions fail by returning NULL, or "" for the ones that let
+ * the script go on */
+static bool value_is_failure(const Value * v)
+{
+	return !v || (v->type == VAL_STRING && (!v->data || !v->data[0]));
+}
+
+static Value *TimedFn(const char *name, State * state, int argc, Expr * argv[])
+{
+	struct perf_record record;
+	Value *ret = NULL;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(timed_functions); i++)
+		if (!strcmp(name, timed_functions[i].name))
+			break;
+	if (i == ARRAY_SIZE(timed_functions))
+		return ErrorAbort(state, "%s is not a timed function", name);
+
+	perf_begin(name);
+	ret = timed_functions[i].fn(name, state, argc, argv);
+	if (perf_end(value_is_failure(ret) ? -1 : 0) && perf_records(&record, 1))
+		perf_report(&record, perf_log);
+
+	return ret;
+}
+
 void Register_libintel_updater(void)
 {
-	RegisterFunction("flash_ifwi", FlashIfwiFn);
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(timed_functions); i++)
+		RegisterFunction(timed_functions[i].name, TimedFn);
 #ifdef TEE_FRAMEWORK
 	RegisterFunction("flash_bom_token", FlashBomFn);
 #endif	/* TEE_FRAMEWORK */
@@ -1076,18 +1038,7 @@ void Register_libintel_updater(void)
 	RegisterFunction("extract_image", ExtractImageFn);
 	RegisterFunction("invalidate_os", InvalidateOsFn);
 	RegisterFunction("restore_os", RestoreOsFn);
-
-	RegisterFunction("flash_capsule", FlashCapsuleFn);
-	RegisterFunction("flash_esp_update", FlashEspUpdateFn);
-	RegisterFunction("flash_ulpmc", FlashUlpmcFn);
-	RegisterFunction("flash_partition", FlashPartition);
-	RegisterFunction("flash_osiptogpt_partition", FlashOsipToGPTPartition);
-	RegisterFunction("flash_image_at_partition", FlashImageAtPartition);
-	RegisterFunction("flash_image_at_offset", FlashImageAtOffset);
-	RegisterFunction("flash_os_image", FlashOSImage);
-	RegisterFunction("write_osip_image", FlashOSImage);
-	RegisterFunction("erase_osip", EraseOsipHeader);
-	RegisterFunction("restore_os", RestoreOsFn);
+	RegisterFunction("smart_flash", SmartFlashFn);
 
 	util_init(recovery_error, NULL);
 }
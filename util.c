@@ -27,13 +27,29 @@
 #include <sys/wait.h>
 #include <sys/mman.h>
 #include <sys/sendfile.h>
-
+#include <sys/ioctl.h>
+#include <stdint.h>
+#include <time.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "perf.h"
 #include "util.h"
 
 #define pr_perror(x)	fprintf(stderr, "%s failed: %s\n", x, strerror(errno))
 
 #define FILEMODE  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH
 
+/* block_write() chunk size and O_DIRECT buffer alignment */
+#define BLOCK_WRITE_CHUNK	(2 * 1024 * 1024)
+#define BLOCK_WRITE_ALIGN	4096
+
+/* Number of tags scan_tags() matches with SIMD, more fall back to bytes */
+#define SCAN_TAGS_MAX	4
+
 int safe_read(int fd, void *data, size_t size)
 {
 	int ret;
@@ -50,6 +66,42 @@ int safe_read(int fd, void *data, size_t size)
 	return 0;
 }
 
+int safe_pwrite(int fd, const void *data, size_t sz, uint64_t offset)
+{
+	const unsigned char *what = (const unsigned char *)data;
+	ssize_t ret;
+
+	while (sz) {
+		ret = pwrite64(fd, what, sz, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		what += ret;
+		offset += ret;
+		sz -= ret;
+	}
+	return 0;
+}
+
+int safe_pread(int fd, void *data, size_t sz, uint64_t offset)
+{
+	unsigned char *bytes = (unsigned char *)data;
+	ssize_t ret;
+
+	while (sz) {
+		ret = pread64(fd, bytes, sz, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		bytes += ret;
+		offset += ret;
+		sz -= ret;
+	}
+	return 0;
+}
+
 int file_read(const char *filename, void **datap, size_t * szp)
 {
 	struct stat sb;
@@ -87,11 +139,801 @@ int file_read(const char *filename, void **datap, size_t * szp)
 	return 0;
 }
 
+static unsigned long elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* Smart flash: compare against what the destination already holds and
+ * only write the chunks that differ. Off unless set_smart_flash() is
+ * called, e.g. through "oem smart_flash on". */
+static bool smart_flash;
+
+void set_smart_flash(bool enable)
+{
+	smart_flash = enable;
+}
+
+struct block_writer {
+	const char *filename;
+	int fd;
+	bool direct;
+	int sector;
+	unsigned char *bounce;
+	bool compare;
+	unsigned char *current[2];	/* destination chunks read back */
+	uint64_t written;
+	uint64_t skipped;
+	block_chunk_fn observe;	/* sees every source chunk before it is written */
+	void *cookie;
+};
+
+/* Open filename for block_writer_write(). O_DIRECT is used on block
+ * devices when offset, and every later offset (which all differ from it
+ * by multiples of align, 0 when there is only one), are sector aligned. */
+static int block_writer_open(struct block_writer *w, const char *filename,
+			     uint64_t offset, size_t align)
+{
+	struct stat sb;
+
+	memset(w, 0, sizeof(*w));
+	w->filename = filename;
+	w->sector = 512;
+
+	w->fd = open(filename, O_RDWR);
+	if (w->fd < 0) {
+		error("block_write: Can't open %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(w->fd, &sb) == 0 && S_ISBLK(sb.st_mode)) {
+		if (ioctl(w->fd, BLKSSZGET, &w->sector) < 0 || w->sector <= 0 || BLOCK_WRITE_ALIGN % w->sector)
+			w->sector = 512;
+		if (offset % w->sector == 0 && align % w->sector == 0 &&
+		    fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) | O_DIRECT) == 0)
+			w->direct = true;
+	}
+
+	if (w->direct && posix_memalign((void **)&w->bounce, BLOCK_WRITE_ALIGN, BLOCK_WRITE_CHUNK)) {
+		error("block_write: Can't allocate bounce buffer\n");
+		close(w->fd);
+		return -1;
+	}
+
+	if (smart_flash) {
+		w->compare = !posix_memalign((void **)&w->current[0], BLOCK_WRITE_ALIGN, BLOCK_WRITE_CHUNK) &&
+			     !posix_memalign((void **)&w->current[1], BLOCK_WRITE_ALIGN, BLOCK_WRITE_CHUNK);
+		if (!w->compare)
+			error("block_write: No memory for smart flash, writing everything\n");
+	}
+	return 0;
+}
+
+/* Write one chunk of at most BLOCK_WRITE_CHUNK bytes */
+static int block_writer_put(struct block_writer *w, uint64_t offset, const unsigned char *what, size_t chunk)
+{
+	const void *buf = what;
+	size_t len = chunk;
+	uint64_t start = perf_now();
+
+	if (w->direct && chunk % w->sector) {
+		/* Unaligned tail: read-modify-write its last sector */
+		len = chunk - chunk % w->sector;
+		if (safe_pread(w->fd, w->bounce + len, w->sector, offset + len)) {
+			error("block_write: Failed to read back %s: %s\n", w->filename, strerror(errno));
+			return -1;
+		}
+		memcpy(w->bounce, what, chunk);
+		buf = w->bounce;
+		len += w->sector;
+	} else if (w->direct && (uintptr_t)what % BLOCK_WRITE_ALIGN) {
+		memcpy(w->bounce, what, chunk);
+		buf = w->bounce;
+	}
+
+	if (safe_pwrite(w->fd, buf, len, offset)) {
+		error("block_write: Failed to write to %s: %s\n", w->filename, strerror(errno));
+		return -1;
+	}
+	w->written += chunk;
+	perf_add(PERF_WRITE, start, chunk);
+	return 0;
+}
+
+/* Reads the destination chunk by chunk, one chunk ahead of the
+ * comparison, into the two block_writer.current buffers */
+struct chunk_reader {
+	struct block_writer *w;
+	uint64_t offset;
+	size_t sz;
+	unsigned count;		/* chunks in the range */
+	unsigned read;		/* chunks read so far */
+	unsigned done;		/* chunks compared so far */
+	bool failed;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static size_t chunk_len(size_t sz, unsigned i)
+{
+	size_t left = sz - (size_t)i * BLOCK_WRITE_CHUNK;
+
+	return left < BLOCK_WRITE_CHUNK ? left : BLOCK_WRITE_CHUNK;
+}
+
+static void *chunk_reader_thread(void *arg)
+{
+	struct chunk_reader *r = arg;
+	struct block_writer *w = r->w;
+	uint64_t start;
+	size_t len;
+	unsigned i;
+	int ret;
+
+	for (i = 0; i < r->count; i++) {
+		pthread_mutex_lock(&r->lock);
+		while (i - r->done >= 2 && !r->failed)
+			pthread_cond_wait(&r->cond, &r->lock);
+		if (r->failed) {
+			pthread_mutex_unlock(&r->lock);
+			break;
+		}
+		pthread_mutex_unlock(&r->lock);
+
+		len = chunk_len(r->sz, i);
+		if (w->direct)
+			len = (len + w->sector - 1) / w->sector * w->sector;
+		start = perf_now();
+		ret = safe_pread(w->fd, w->current[i % 2], len, r->offset + (uint64_t)i * BLOCK_WRITE_CHUNK);
+		if (!ret)
+			perf_add(PERF_READ, start, len);
+
+		pthread_mutex_lock(&r->lock);
+		if (ret)
+			r->failed = true;
+		else
+			r->read++;
+		pthread_cond_signal(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+		if (ret)
+			break;
+	}
+	return NULL;
+}
+
+static int block_writer_write(struct block_writer *w, uint64_t offset, const void *data, size_t sz)
+{
+	const unsigned char *what = (const unsigned char *)data;
+	struct chunk_reader r;
+	pthread_t thread;
+	bool same;
+	size_t len;
+	unsigned i;
+	int ret = 0;
+
+	if (!w->compare) {
+		while (sz && !ret) {
+			len = chunk_len(sz, 0);
+			if (w->observe && w->observe(what, len, w->cookie))
+				return -1;
+			ret = block_writer_put(w, offset, what, len);
+			what += len;
+			offset += len;
+			sz -= len;
+		}
+		return ret;
+	}
+
+	memset(&r, 0, sizeof(r));
+	r.w = w;
+	r.offset = offset;
+	r.sz = sz;
+	r.count = (sz + BLOCK_WRITE_CHUNK - 1) / BLOCK_WRITE_CHUNK;
+	pthread_mutex_init(&r.lock, NULL);
+	pthread_cond_init(&r.cond, NULL);
+	if (pthread_create(&thread, NULL, chunk_reader_thread, &r)) {
+		pthread_mutex_destroy(&r.lock);
+		pthread_cond_destroy(&r.cond);
+		w->compare = false;
+		return block_writer_write(w, offset, data, sz);
+	}
+
+	for (i = 0; i < r.count && !ret; i++) {
+		len = chunk_len(sz, i);
+		if (w->observe && w->observe(what, len, w->cookie))
+			ret = -1;
+
+		pthread_mutex_lock(&r.lock);
+		while (r.read <= i && !r.failed)
+			pthread_cond_wait(&r.cond, &r.lock);
+		same = r.read > i && !memcmp(w->current[i % 2], what, len);
+		pthread_mutex_unlock(&r.lock);
+
+		/* A chunk that could not be read back is simply written */
+		if (!ret && same)
+			w->skipped += len;
+		else if (!ret)
+			ret = block_writer_put(w, offset, what, len);
+
+		pthread_mutex_lock(&r.lock);
+		r.done++;
+		if (ret)
+			r.failed = true;
+		pthread_cond_signal(&r.cond);
+		pthread_mutex_unlock(&r.lock);
+
+		what += len;
+		offset += len;
+	}
+
+	pthread_join(thread, NULL);
+	pthread_mutex_destroy(&r.lock);
+	pthread_cond_destroy(&r.cond);
+	return ret;
+}
+
+/* Sync (unless ret already reports a failure) and release the writer */
+static int block_writer_close(struct block_writer *w, int ret)
+{
+	uint64_t start = perf_now();
+
+	if (!ret && fsync(w->fd)) {
+		error("block_write: Failed to sync %s: %s\n", w->filename, strerror(errno));
+		ret = -1;
+	}
+	if (!ret)
+		perf_add(PERF_FSYNC, start, 0);
+	free(w->bounce);
+	free(w->current[0]);
+	free(w->current[1]);
+	close(w->fd);
+	return ret;
+}
+
+/**
+ * Writes a buffer to a block device (or file) at a given byte offset.
+ *
+ * Block devices are written with O_DIRECT in BLOCK_WRITE_CHUNK chunks
+ * when the offset is sector aligned, so large images do not go through
+ * the page cache. Chunks that are not suitably aligned in memory go
+ * through a bounce buffer, and a partial last sector is read, patched
+ * and written back. Anything else falls back to buffered writes.
+ *
+ * @param [in] filename Device node or file to write to.
+ * @param [in] offset Byte offset in the destination.
+ * @param [in] data Data to write.
+ * @param [in] sz Number of bytes to write.
+ *
+ * @return 0 if successful
+ * @return -1 otherwise
+ */
+int block_write(const char *filename, uint64_t offset, const void *data, size_t sz)
+{
+	return block_write_ex(filename, offset, data, sz, NULL, NULL);
+}
+
+/**
+ * Same as block_write(), but fn is called on each chunk of data, in
+ * order, right before that chunk is written, e.g. to hash the source
+ * while it is still in cache. A non zero return aborts the write.
+ */
+int block_write_ex(const char *filename, uint64_t offset, const void *data, size_t sz,
+		   block_chunk_fn fn, void *cookie)
+{
+	struct block_writer w;
+	struct timespec start;
+	unsigned long ms;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (block_writer_open(&w, filename, offset, 0))
+		return -1;
+	w.observe = fn;
+	w.cookie = cookie;
+
+	ret = block_writer_close(&w, block_writer_write(&w, offset, data, sz));
+	if (ret)
+		return ret;
+
+	ms = elapsed_ms(&start);
+	printf("block_write: %zu bytes to %s in %lu ms (%llu KiB/s%s), %llu written, %llu unchanged\n",
+	       sz, filename, ms, (unsigned long long)sz * 1000 / 1024 / (ms ? ms : 1),
+	       w.direct ? ", direct" : "", (unsigned long long)w.written, (unsigned long long)w.skipped);
+	return 0;
+}
+
+/**
+ * Reads sz bytes of a block device (or file) from a given byte offset and
+ * hands them to fn chunk by chunk, in order. Block devices are read with
+ * O_DIRECT, bypassing the page cache so the data really comes from the
+ * device, and a worker thread reads the next chunk while fn runs.
+ *
+ * @return 0 if successful
+ * @return -1 if the read fails or fn returns non zero
+ */
+int block_read_chunks(const char *filename, uint64_t offset, size_t sz,
+		      block_chunk_fn fn, void *cookie)
+{
+	struct block_writer w;
+	struct chunk_reader r;
+	struct stat sb;
+	pthread_t thread;
+	size_t len;
+	unsigned i;
+	int ret = 0;
+
+	memset(&w, 0, sizeof(w));
+	w.filename = filename;
+	w.sector = 512;
+
+	w.fd = open(filename, O_RDONLY);
+	if (w.fd < 0) {
+		error("block_read: Can't open %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(w.fd, &sb) == 0 && S_ISBLK(sb.st_mode)) {
+		if (ioctl(w.fd, BLKSSZGET, &w.sector) < 0 || w.sector <= 0 || BLOCK_WRITE_ALIGN % w.sector)
+			w.sector = 512;
+		if (offset % w.sector == 0 && fcntl(w.fd, F_SETFL, fcntl(w.fd, F_GETFL) | O_DIRECT) == 0)
+			w.direct = true;
+	}
+
+	if (posix_memalign((void **)&w.current[0], BLOCK_WRITE_ALIGN, BLOCK_WRITE_CHUNK) ||
+	    posix_memalign((void **)&w.current[1], BLOCK_WRITE_ALIGN, BLOCK_WRITE_CHUNK)) {
+		error("block_read: Can't allocate read buffers\n");
+		ret = -1;
+		goto out;
+	}
+
+	memset(&r, 0, sizeof(r));
+	r.w = &w;
+	r.offset = offset;
+	r.sz = sz;
+	r.count = (sz + BLOCK_WRITE_CHUNK - 1) / BLOCK_WRITE_CHUNK;
+	pthread_mutex_init(&r.lock, NULL);
+	pthread_cond_init(&r.cond, NULL);
+	if (pthread_create(&thread, NULL, chunk_reader_thread, &r)) {
+		error("block_read: Can't start reader thread\n");
+		ret = -1;
+		goto destroy;
+	}
+
+	for (i = 0; i < r.count && !ret; i++) {
+		len = chunk_len(sz, i);
+
+		pthread_mutex_lock(&r.lock);
+		while (r.read <= i && !r.failed)
+			pthread_cond_wait(&r.cond, &r.lock);
+		if (r.read <= i)
+			ret = -1;
+		pthread_mutex_unlock(&r.lock);
+
+		if (ret)
+			error("block_read: Failed to read %s: %s\n", filename, strerror(errno));
+		else if (fn(w.current[i % 2], len, cookie))
+			ret = -1;
+
+		pthread_mutex_lock(&r.lock);
+		r.done++;
+		if (ret)
+			r.failed = true;
+		pthread_cond_signal(&r.cond);
+		pthread_mutex_unlock(&r.lock);
+	}
+
+	pthread_join(thread, NULL);
+destroy:
+	pthread_mutex_destroy(&r.lock);
+	pthread_cond_destroy(&r.cond);
+out:
+	free(w.current[0]);
+	free(w.current[1]);
+	close(w.fd);
+	return ret;
+}
+
+/* Streams data arriving piecewise to a block device: the caller fills one
+ * of two BLOCK_WRITE_CHUNK buffers while a thread writes the other, so
+ * writing overlaps with whatever produces the data and no more than two
+ * chunks are ever held. */
+struct block_stream {
+	struct block_writer w;
+	uint64_t offset;	/* where the next submitted chunk goes */
+	uint64_t size;
+	unsigned char *buf[2];
+	unsigned cur;		/* buffer being filled */
+	size_t fill;
+	size_t pending;		/* bytes of buf[!cur] left to write, 0 if none */
+	bool closing;
+	int ret;
+	struct timespec start;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void *block_stream_thread(void *arg)
+{
+	struct block_stream *s = arg;
+	unsigned char *buf;
+	size_t len;
+	int ret;
+
+	pthread_mutex_lock(&s->lock);
+	for (;;) {
+		while (!s->pending && !s->closing)
+			pthread_cond_wait(&s->cond, &s->lock);
+		if (!s->pending)
+			break;
+		len = s->pending;
+		buf = s->buf[!s->cur];
+		pthread_mutex_unlock(&s->lock);
+
+		ret = block_writer_put(&s->w, s->offset, buf, len);
+
+		pthread_mutex_lock(&s->lock);
+		s->offset += len;
+		s->pending = 0;
+		if (ret)
+			s->ret = ret;
+		pthread_cond_signal(&s->cond);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+/* Hand the buffer being filled to the writer thread */
+static int block_stream_submit(struct block_stream *s)
+{
+	int ret;
+
+	if (s->w.observe && s->w.observe(s->buf[s->cur], s->fill, s->w.cookie))
+		return -1;
+
+	pthread_mutex_lock(&s->lock);
+	while (s->pending)
+		pthread_cond_wait(&s->cond, &s->lock);
+	ret = s->ret;
+	if (!ret) {
+		s->pending = s->fill;
+		s->cur = !s->cur;
+		s->fill = 0;
+		pthread_cond_signal(&s->cond);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return ret;
+}
+
+/**
+ * Opens filename for block_stream_write() from a given byte offset.
+ * fn, if not NULL, sees every chunk right before it is written, as with
+ * block_write_ex().
+ *
+ * @return the stream, or NULL on error
+ */
+struct block_stream *block_stream_open(const char *filename, uint64_t offset,
+				       block_chunk_fn fn, void *cookie)
+{
+	struct block_stream *s;
+
+	s = calloc(1, sizeof(*s));
+	if (!s) {
+		error("block_stream: Out of memory\n");
+		return NULL;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &s->start);
+
+	if (block_writer_open(&s->w, filename, offset, BLOCK_WRITE_CHUNK))
+		goto free;
+	s->w.observe = fn;
+	s->w.cookie = cookie;
+	s->offset = offset;
+
+	if (posix_memalign((void **)&s->buf[0], BLOCK_WRITE_ALIGN, BLOCK_WRITE_CHUNK) ||
+	    posix_memalign((void **)&s->buf[1], BLOCK_WRITE_ALIGN, BLOCK_WRITE_CHUNK)) {
+		error("block_stream: Can't allocate stream buffers\n");
+		goto close;
+	}
+
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	if (pthread_create(&s->thread, NULL, block_stream_thread, s)) {
+		error("block_stream: Can't start writer thread\n");
+		pthread_mutex_destroy(&s->lock);
+		pthread_cond_destroy(&s->cond);
+		goto close;
+	}
+	return s;
+
+close:
+	free(s->buf[0]);
+	free(s->buf[1]);
+	block_writer_close(&s->w, -1);
+free:
+	free(s);
+	return NULL;
+}
+
+/**
+ * Appends len bytes to the stream. Only returns once they are copied,
+ * but usually before they are written.
+ *
+ * @return 0 if successful
+ * @return -1 if this or an earlier write failed
+ */
+int block_stream_write(struct block_stream *s, const void *data, size_t len)
+{
+	const unsigned char *what = data;
+	size_t n;
+
+	while (len) {
+		n = BLOCK_WRITE_CHUNK - s->fill;
+		if (n > len)
+			n = len;
+		memcpy(s->buf[s->cur] + s->fill, what, n);
+		s->fill += n;
+		s->size += n;
+		what += n;
+		len -= n;
+
+		if (s->fill == BLOCK_WRITE_CHUNK && block_stream_submit(s))
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * Writes what is left, syncs and frees the stream. With abort set the
+ * data still buffered is dropped and the stream reported as failed.
+ *
+ * @return 0 if every write succeeded
+ * @return -1 otherwise
+ */
+int block_stream_close(struct block_stream *s, bool abort)
+{
+	unsigned long ms;
+	int ret = abort ? -1 : 0;
+
+	if (!ret && s->fill)
+		ret = block_stream_submit(s);
+
+	pthread_mutex_lock(&s->lock);
+	s->closing = true;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	pthread_join(s->thread, NULL);
+	if (!ret)
+		ret = s->ret;
+
+	ret = block_writer_close(&s->w, ret);
+	if (!ret) {
+		ms = elapsed_ms(&s->start);
+		printf("block_stream: %llu bytes to %s in %lu ms (%llu KiB/s%s)\n",
+		       (unsigned long long)s->size, s->w.filename, ms,
+		       (unsigned long long)s->size * 1000 / 1024 / (ms ? ms : 1),
+		       s->w.direct ? ", direct" : "");
+	}
+
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+	free(s->buf[0]);
+	free(s->buf[1]);
+	free(s);
+	return ret;
+}
+
+/* Android sparse image format, see system/core/libsparse/sparse_format.h */
+#define SPARSE_HEADER_MAGIC	0xed26ff3a
+#define CHUNK_TYPE_RAW		0xCAC1
+#define CHUNK_TYPE_FILL		0xCAC2
+#define CHUNK_TYPE_DONT_CARE	0xCAC3
+#define CHUNK_TYPE_CRC32	0xCAC4
+
+struct sparse_header {
+	uint32_t magic;
+	uint16_t major_version;
+	uint16_t minor_version;
+	uint16_t file_hdr_sz;
+	uint16_t chunk_hdr_sz;
+	uint32_t blk_sz;
+	uint32_t total_blks;
+	uint32_t total_chunks;
+	uint32_t image_checksum;
+};
+
+struct sparse_chunk_header {
+	uint16_t chunk_type;
+	uint16_t reserved1;
+	uint32_t chunk_sz;
+	uint32_t total_sz;
+};
+
+bool is_sparse_image(const void *data, size_t sz)
+{
+	struct sparse_header hdr;
+
+	if (sz < sizeof(hdr))
+		return false;
+
+	memcpy(&hdr, data, sizeof(hdr));
+	return hdr.magic == SPARSE_HEADER_MAGIC;
+}
+
+/* Write len bytes of a repeated 32 bit pattern. Zeroes are handed to the
+ * eMMC with BLKZEROOUT when the kernel supports it. */
+static int sparse_fill(struct block_writer *w, uint64_t offset, uint32_t pattern, uint64_t len)
+{
+	uint64_t range[2] = { offset, len };
+	uint64_t start = perf_now();
+	uint32_t *fill;
+	size_t fill_sz, chunk, i;
+	int ret = 0;
+
+	if (!pattern && w->direct && ioctl(w->fd, BLKZEROOUT, range) == 0) {
+		w->written += len;
+		perf_add(PERF_WRITE, start, len);
+		return 0;
+	}
+
+	fill_sz = len < BLOCK_WRITE_CHUNK ? len : BLOCK_WRITE_CHUNK;
+	if (posix_memalign((void **)&fill, BLOCK_WRITE_ALIGN, fill_sz)) {
+		error("sparse_write: Can't allocate fill buffer\n");
+		return -1;
+	}
+	for (i = 0; i < fill_sz / sizeof(*fill); i++)
+		fill[i] = pattern;
+
+	while (len && !ret) {
+		chunk = len < fill_sz ? len : fill_sz;
+		ret = block_writer_write(w, offset, fill, chunk);
+		offset += chunk;
+		len -= chunk;
+	}
+
+	free(fill);
+	return ret;
+}
+
+/**
+ * Writes an Android sparse image to a block device (or file) at a given
+ * byte offset, without expanding it in memory.
+ *
+ * RAW chunks are written as they are, FILL chunks are expanded from a
+ * pattern buffer (or zeroed with BLKZEROOUT) and DONT_CARE chunks are
+ * skipped, leaving whatever the destination held.
+ *
+ * @param [in] filename Device node or file to write to.
+ * @param [in] offset Byte offset of the expanded image in the destination.
+ * @param [in] data Sparse image.
+ * @param [in] sz Size of the sparse image.
+ *
+ * @return 0 if successful
+ * @return -1 otherwise
+ */
+int sparse_write(const char *filename, uint64_t offset, const void *data, size_t sz)
+{
+	const unsigned char *image = (const unsigned char *)data;
+	struct sparse_header hdr;
+	struct sparse_chunk_header chunk;
+	struct block_writer w;
+	struct timespec start;
+	uint64_t dev_size, out_size, len, written = 0;
+	uint32_t blk = 0, pattern, i;
+	size_t pos, body;
+	unsigned long ms;
+	int ret = -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (!is_sparse_image(data, sz)) {
+		error("sparse_write: Not a sparse image\n");
+		return -1;
+	}
+	memcpy(&hdr, data, sizeof(hdr));
+	if (hdr.major_version != 1 || hdr.file_hdr_sz < sizeof(hdr) || hdr.file_hdr_sz > sz ||
+	    hdr.chunk_hdr_sz < sizeof(chunk) || !hdr.blk_sz || hdr.blk_sz % sizeof(uint32_t)) {
+		error("sparse_write: Unsupported sparse image header\n");
+		return -1;
+	}
+	out_size = (uint64_t)hdr.total_blks * hdr.blk_sz;
+
+	if (block_writer_open(&w, filename, offset, hdr.blk_sz))
+		return -1;
+
+	if (ioctl(w.fd, BLKGETSIZE64, &dev_size) == 0 && offset + out_size > dev_size) {
+		error("sparse_write: %llu byte image does not fit in %s\n",
+		      (unsigned long long)out_size, filename);
+		goto out;
+	}
+
+	pos = hdr.file_hdr_sz;
+	for (i = 0; i < hdr.total_chunks; i++) {
+		if (sz - pos < hdr.chunk_hdr_sz) {
+			error("sparse_write: Truncated chunk header %u\n", i);
+			goto out;
+		}
+		memcpy(&chunk, image + pos, sizeof(chunk));
+		if (chunk.total_sz < hdr.chunk_hdr_sz || chunk.total_sz > sz - pos) {
+			error("sparse_write: Bad size for chunk %u\n", i);
+			goto out;
+		}
+		body = pos + hdr.chunk_hdr_sz;
+		len = (uint64_t)chunk.chunk_sz * hdr.blk_sz;
+		if (chunk.chunk_type != CHUNK_TYPE_CRC32 && chunk.chunk_sz > hdr.total_blks - blk) {
+			error("sparse_write: Chunk %u goes past the end of the image\n", i);
+			goto out;
+		}
+
+		switch (chunk.chunk_type) {
+		case CHUNK_TYPE_RAW:
+			if (chunk.total_sz - hdr.chunk_hdr_sz != len) {
+				error("sparse_write: Bad RAW chunk %u\n", i);
+				goto out;
+			}
+			if (block_writer_write(&w, offset + (uint64_t)blk * hdr.blk_sz, image + body, len))
+				goto out;
+			written += len;
+			break;
+		case CHUNK_TYPE_FILL:
+			if (chunk.total_sz - hdr.chunk_hdr_sz != sizeof(pattern)) {
+				error("sparse_write: Bad FILL chunk %u\n", i);
+				goto out;
+			}
+			memcpy(&pattern, image + body, sizeof(pattern));
+			if (sparse_fill(&w, offset + (uint64_t)blk * hdr.blk_sz, pattern, len))
+				goto out;
+			written += len;
+			break;
+		case CHUNK_TYPE_DONT_CARE:
+		case CHUNK_TYPE_CRC32:
+			break;
+		default:
+			error("sparse_write: Unknown chunk type 0x%x\n", chunk.chunk_type);
+			goto out;
+		}
+
+		if (chunk.chunk_type != CHUNK_TYPE_CRC32)
+			blk += chunk.chunk_sz;
+		pos += chunk.total_sz;
+	}
+	ret = 0;
+
+out:
+	ret = block_writer_close(&w, ret);
+	if (ret)
+		return ret;
+
+	ms = elapsed_ms(&start);
+	printf("sparse_write: %llu of %llu bytes to %s in %lu ms (%llu KiB/s%s), %llu written, %llu unchanged\n",
+	       (unsigned long long)written, (unsigned long long)out_size, filename, ms,
+	       (unsigned long long)written * 1000 / 1024 / (ms ? ms : 1), w.direct ? ", direct" : "",
+	       (unsigned long long)w.written, (unsigned long long)w.skipped);
+	return 0;
+}
+
+/* Write a raw or an Android sparse image */
+int image_write(const char *filename, uint64_t offset, const void *data, size_t sz)
+{
+	if (is_sparse_image(data, sz))
+		return sparse_write(filename, offset, data, sz);
+
+	return block_write(filename, offset, data, sz);
+}
+
 int file_write(const char *filename, const void *data, size_t sz)
 {
 	int fd;
 	int ret;
 	const unsigned char *what = (const unsigned char *)data;
+	struct stat sb;
+
+	if (stat(filename, &sb) == 0 && S_ISBLK(sb.st_mode))
+		return block_write(filename, 0, data, sz);
 
 	fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, FILEMODE);
 	if (fd < 0) {
@@ -275,6 +1117,83 @@ int is_hex(char c)
 	return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'F') || (c >= 'a' && c <= 'f');
 }
 
+static int scan_tags_at(const unsigned char *data, size_t offset, const char *const *tags,
+			int ntags, scan_tags_fn fn, void *cookie)
+{
+	int i, ret;
+
+	for (i = 0; i < ntags; i++) {
+		if (memcmp(data + offset, tags[i], SCAN_TAG_LEN))
+			continue;
+		ret = fn(offset, i, cookie);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+int scan_tags(const void *data, size_t size, const char *const *tags, int ntags,
+	      scan_tags_fn fn, void *cookie)
+{
+	const unsigned char *bytes = data;
+	size_t offset = 0;
+	int ret;
+
+	if (size < SCAN_TAG_LEN)
+		return 0;
+
+#ifdef __SSE2__
+	/* Compare 16 candidate offsets at once: lane j of window k holds
+	 * byte offset + j + k, so a tag starts at offset + j when all four
+	 * windows match its bytes in lane j. */
+	{
+		__m128i first[SCAN_TAGS_MAX], second[SCAN_TAGS_MAX];
+		__m128i third[SCAN_TAGS_MAX], fourth[SCAN_TAGS_MAX];
+		int i;
+
+		if (ntags > SCAN_TAGS_MAX)
+			goto scalar;
+
+		for (i = 0; i < ntags; i++) {
+			first[i] = _mm_set1_epi8(tags[i][0]);
+			second[i] = _mm_set1_epi8(tags[i][1]);
+			third[i] = _mm_set1_epi8(tags[i][2]);
+			fourth[i] = _mm_set1_epi8(tags[i][3]);
+		}
+
+		for (; offset + 16 + SCAN_TAG_LEN - 1 <= size; offset += 16) {
+			__m128i w0 = _mm_loadu_si128((const __m128i *)(bytes + offset));
+			__m128i w1 = _mm_loadu_si128((const __m128i *)(bytes + offset + 1));
+			__m128i w2 = _mm_loadu_si128((const __m128i *)(bytes + offset + 2));
+			__m128i w3 = _mm_loadu_si128((const __m128i *)(bytes + offset + 3));
+			unsigned int mask = 0;
+
+			for (i = 0; i < ntags; i++) {
+				__m128i m = _mm_and_si128(_mm_cmpeq_epi8(w0, first[i]),
+							  _mm_cmpeq_epi8(w1, second[i]));
+				m = _mm_and_si128(m, _mm_cmpeq_epi8(w2, third[i]));
+				m = _mm_and_si128(m, _mm_cmpeq_epi8(w3, fourth[i]));
+				mask |= _mm_movemask_epi8(m);
+			}
+
+			while (mask) {
+				ret = scan_tags_at(bytes, offset + __builtin_ctz(mask), tags, ntags, fn, cookie);
+				if (ret)
+					return ret;
+				mask &= mask - 1;
+			}
+		}
+	}
+scalar:
+#endif
+	for (; offset + SCAN_TAG_LEN <= size; offset++) {
+		ret = scan_tags_at(bytes, offset, tags, ntags, fn, cookie);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
 void eprintf(const char *msg)
 {
 	fprintf(stderr, "%s", msg);
@@ -286,6 +1205,52 @@ static void (*print_fun) (const char *msg) = (void (*)(const char *))printf;
 
 #define MSG_BUF_LENGTH 256
 
+/* Threads that work in the background of the fastboot commands must not
+ * answer them: their messages only go to the logs. A command thread can
+ * also keep quiet for a while, e.g. while probing something that may well
+ * not be there. */
+#define THREAD_BACKGROUND	(1 << 0)
+#define THREAD_QUIET		(1 << 1)
+
+static pthread_key_t thread_flags_key;
+static pthread_once_t thread_flags_once = PTHREAD_ONCE_INIT;
+
+static void thread_flags_key_create(void)
+{
+	pthread_key_create(&thread_flags_key, NULL);
+}
+
+static uintptr_t thread_flags(void)
+{
+	pthread_once(&thread_flags_once, thread_flags_key_create);
+	return (uintptr_t)pthread_getspecific(thread_flags_key);
+}
+
+static void set_thread_flags(uintptr_t flags)
+{
+	pthread_setspecific(thread_flags_key, (void *)flags);
+}
+
+void util_background_thread(void)
+{
+	set_thread_flags(thread_flags() | THREAD_BACKGROUND | THREAD_QUIET);
+}
+
+bool util_in_background(void)
+{
+	return thread_flags() & THREAD_BACKGROUND;
+}
+
+/* Returns the previous setting, to restore it with */
+bool util_quiet(bool quiet)
+{
+	uintptr_t flags = thread_flags();
+
+	if (!(flags & THREAD_BACKGROUND))
+		set_thread_flags(quiet ? flags | THREAD_QUIET : flags & ~THREAD_QUIET);
+	return flags & THREAD_QUIET;
+}
+
 void error(const char *fmt, ...)
 {
 	char buf[MSG_BUF_LENGTH];
@@ -295,6 +1260,11 @@ void error(const char *fmt, ...)
 	vsnprintf(buf, sizeof(buf), fmt, argptr);
 	va_end(argptr);
 
+	if (thread_flags() & THREAD_QUIET) {
+		eprintf(buf);
+		return;
+	}
+
 	error_fun(buf);
 	/* Be sure that logs are printed in any ways */
 	if ((void *)error_fun != (void *)printf)
@@ -310,6 +1280,11 @@ void print(const char *fmt, ...)
 	vsnprintf(buf, sizeof(buf), fmt, argptr);
 	va_end(argptr);
 
+	if (thread_flags() & THREAD_QUIET) {
+		eprintf(buf);
+		return;
+	}
+
 	print_fun(buf);
 	/* Be sure that logs are printed in any ways */
 	if (print_fun != eprintf)
@@ -19,12 +19,28 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #define BY_NAME_DIR "/dev/block/by-name"
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(*(x)))
 
 int file_write(const char *filename, const void *what, size_t sz);
+int block_write(const char *filename, uint64_t offset, const void *data, size_t sz);
+typedef int (*block_chunk_fn) (const void *chunk, size_t len, void *cookie);
+int block_write_ex(const char *filename, uint64_t offset, const void *data, size_t sz,
+		   block_chunk_fn fn, void *cookie);
+int block_read_chunks(const char *filename, uint64_t offset, size_t sz,
+		      block_chunk_fn fn, void *cookie);
+struct block_stream;
+struct block_stream *block_stream_open(const char *filename, uint64_t offset,
+				       block_chunk_fn fn, void *cookie);
+int block_stream_write(struct block_stream *s, const void *data, size_t len);
+int block_stream_close(struct block_stream *s, bool abort);
+bool is_sparse_image(const void *data, size_t sz);
+int sparse_write(const char *filename, uint64_t offset, const void *data, size_t sz);
+int image_write(const char *filename, uint64_t offset, const void *data, size_t sz);
+void set_smart_flash(bool enable);
 int file_string_write(const char *filename, const char *what);
 void dump_trace_file(const char *filename);
 int file_read(const char *filename, void **datap, size_t * szp);
@@ -32,12 +48,22 @@ int file_copy(const char *src, const char *dst);
 int file_size(const char *filename);
 void *file_mmap(const char *filename, size_t length, bool writable);
 int safe_read(int fd, void *data, size_t size);
+int safe_pread(int fd, void *data, size_t size, uint64_t offset);
+int safe_pwrite(int fd, const void *data, size_t size, uint64_t offset);
 int snhexdump(char *str, size_t size, const unsigned char *data, unsigned int sz);
 void hexdump_buffer(const unsigned char *buffer, unsigned int buffer_size, void
 		     (*printrow) (const char *text), unsigned int bytes_per_row);
 void twoscomplement(unsigned char *cs, unsigned char *buf, unsigned int size);
 int is_hex(char c);
 
+/* scan_tags() calls fn for every offset of data where one of the 4 byte
+ * tags starts, in increasing offset order, and stops as soon as fn returns
+ * non zero (which is then returned). */
+#define SCAN_TAG_LEN	4
+typedef int (*scan_tags_fn) (size_t offset, int tag, void *cookie);
+int scan_tags(const void *data, size_t size, const char *const *tags, int ntags,
+	      scan_tags_fn fn, void *cookie);
+
 void error(const char *fmt, ...);
 void print(const char *fmt, ...);
 
@@ -45,5 +71,8 @@ int call_program(const char *path, const char *log_file,
 		 const char *pass_string, unsigned int timeout, char *argv[]);
 
 void util_init(void (*err_fun) (const char *), void (*pr_fun) (const char *));
+void util_background_thread(void);
+bool util_in_background(void);
+bool util_quiet(bool quiet);
 
 #endif
@@ -0,0 +1,225 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flash.h"
+#include "perf.h"
+#include "util.h"
+#include "verify.h"
+
+static int sha_chunk(const void *chunk, size_t len, void *cookie)
+{
+	uint64_t start = perf_now();
+
+	SHA_update((SHA_CTX *) cookie, chunk, len);
+	perf_add(PERF_VERIFY, start, len);
+	return 0;
+}
+
+static void print_sha1(const char *prefix, const uint8_t *digest)
+{
+	char str[SHA_DIGEST_SIZE * 2 + 1];
+	int i;
+
+	for (i = 0; i < SHA_DIGEST_SIZE; i++)
+		snprintf(str + i * 2, 3, "%02x", digest[i]);
+	error("%s%s\n", prefix, str);
+}
+
+/**
+ * Reads sz bytes of filename back from offset, bypassing the page
+ * cache, and checks their SHA1 against digest.
+ *
+ * @return 0 if the region matches
+ * @return -1 otherwise
+ */
+int verify_region(const char *filename, uint64_t offset, size_t sz,
+		  const uint8_t digest[SHA_DIGEST_SIZE])
+{
+	const uint8_t *read;
+	SHA_CTX ctx;
+
+	SHA_init(&ctx);
+	if (block_read_chunks(filename, offset, sz, sha_chunk, &ctx))
+		return -1;
+
+	read = SHA_final(&ctx);
+	if (memcmp(read, digest, SHA_DIGEST_SIZE)) {
+		error("%s: readback mismatch at offset %llu (%zu bytes)\n",
+		      filename, (unsigned long long)offset, sz);
+		print_sha1("  expected ", digest);
+		print_sha1("  read     ", read);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * image_write() followed by a readback check. The SHA1 of the source is
+ * computed chunk by chunk while each chunk is handed to the device, so
+ * the source is only walked once. After block_write_ex() has synced the
+ * device, the region is read back with O_DIRECT and its digest compared.
+ *
+ * Sparse images are expanded on the fly and are not read back.
+ *
+ * @return 0 if successful
+ * @return -1 if the write or the verification fails
+ */
+int verified_write(const char *filename, uint64_t offset, const void *data, size_t sz)
+{
+	uint8_t digest[SHA_DIGEST_SIZE];
+	SHA_CTX ctx;
+
+	if (is_sparse_image(data, sz))
+		return sparse_write(filename, offset, data, sz);
+
+	SHA_init(&ctx);
+	if (block_write_ex(filename, offset, data, sz, sha_chunk, &ctx))
+		return -1;
+	memcpy(digest, SHA_final(&ctx), SHA_DIGEST_SIZE);
+
+	return verify_region(filename, offset, sz, digest);
+}
+
+struct verified_stream {
+	struct block_stream *bs;
+	char *filename;
+	uint64_t offset;
+	size_t size;
+	SHA_CTX ctx;
+};
+
+static int sha_stream_chunk(const void *chunk, size_t len, void *cookie)
+{
+	struct verified_stream *s = cookie;
+
+	s->size += len;
+	return sha_chunk(chunk, len, &s->ctx);
+}
+
+/**
+ * verified_write() for data that arrives piecewise: see
+ * block_stream_open(). The readback check happens on close.
+ *
+ * @return the stream, or NULL on error
+ */
+struct verified_stream *verified_stream_open(const char *filename, uint64_t offset)
+{
+	struct verified_stream *s;
+
+	s = calloc(1, sizeof(*s));
+	if (!s || !(s->filename = strdup(filename))) {
+		error("verified_stream: Out of memory\n");
+		free(s);
+		return NULL;
+	}
+	s->offset = offset;
+	SHA_init(&s->ctx);
+
+	s->bs = block_stream_open(s->filename, offset, sha_stream_chunk, s);
+	if (!s->bs) {
+		free(s->filename);
+		free(s);
+		return NULL;
+	}
+	return s;
+}
+
+int verified_stream_write(struct verified_stream *s, const void *data, size_t len)
+{
+	return block_stream_write(s->bs, data, len);
+}
+
+/**
+ * Closes the stream (see block_stream_close()) and reads back what was
+ * written to check it.
+ *
+ * @return 0 if successful
+ * @return -1 if a write or the verification failed
+ */
+int verified_stream_close(struct verified_stream *s, bool abort)
+{
+	uint8_t digest[SHA_DIGEST_SIZE];
+	int ret;
+
+	ret = block_stream_close(s->bs, abort);
+	if (!ret) {
+		memcpy(digest, SHA_final(&s->ctx), SHA_DIGEST_SIZE);
+		ret = verify_region(s->filename, s->offset, s->size, digest);
+	}
+
+	free(s->filename);
+	free(s);
+	return ret;
+}
+
+/**
+ * Checks the SHA1 of the flashed image name, as returned by the
+ * bootimage backend (boot image header and payload on GPT, OSII content
+ * with its regenerated header on OSIP).
+ *
+ * @return 0 if the image matches digest
+ * @return -1 otherwise
+ */
+int verify_image(const char *name, const uint8_t digest[SHA_DIGEST_SIZE])
+{
+	uint8_t read[SHA_DIGEST_SIZE];
+	uint64_t start;
+	void *data;
+	int size;
+	int ret = 0;
+
+	start = perf_now();
+	size = map_image(name, &data);
+	if (size < 0) {
+		error("verify_image: Can't read %s image\n", name);
+		return -1;
+	}
+	perf_add(PERF_READ, start, size);
+
+	start = perf_now();
+	SHA_hash(data, size, read);
+	perf_add(PERF_VERIFY, start, size);
+	if (memcmp(read, digest, SHA_DIGEST_SIZE)) {
+		error("verify_image: %s image does not match\n", name);
+		ret = -1;
+	}
+
+	unmap_image(data, size);
+	return ret;
+}
+
+int parse_sha1(const char *str, uint8_t digest[SHA_DIGEST_SIZE])
+{
+	unsigned int byte;
+	int i;
+
+	if (strlen(str) != SHA_DIGEST_SIZE * 2)
+		return -1;
+
+	for (i = 0; i < SHA_DIGEST_SIZE; i++) {
+		if (!is_hex(str[i * 2]) || !is_hex(str[i * 2 + 1]) ||
+		    sscanf(str + i * 2, "%2x", &byte) != 1)
+			return -1;
+		digest[i] = byte;
+	}
+
+	return 0;
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _VERIFY_H_
+#define _VERIFY_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <mincrypt/sha.h>
+
+int verified_write(const char *filename, uint64_t offset, const void *data, size_t sz);
+struct verified_stream;
+struct verified_stream *verified_stream_open(const char *filename, uint64_t offset);
+int verified_stream_write(struct verified_stream *s, const void *data, size_t len);
+int verified_stream_close(struct verified_stream *s, bool abort);
+int verify_region(const char *filename, uint64_t offset, size_t sz,
+		  const uint8_t digest[SHA_DIGEST_SIZE]);
+int verify_image(const char *name, const uint8_t digest[SHA_DIGEST_SIZE]);
+int parse_sha1(const char *str, uint8_t digest[SHA_DIGEST_SIZE]);
+
+#endif	/* _VERIFY_H_ */